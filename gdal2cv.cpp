@@ -40,7 +40,26 @@
 //M*/
 
 #include "gdal2cv.h"
+
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_virtualmem.h>
+#include <cpl_vsi.h>
+#include <gdal_frmts.h>
+
+#if (CV_VERSION_MAJOR > 3) || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 1)
+#include <opencv2/core/hal/intrin.hpp>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 /**
@@ -63,7 +82,7 @@ int  KGDAL2CV::gdalPaletteInterpretation2OpenCV(GDALPaletteInterp const& palette
 
 		/// RGB
 	case GPI_RGB:
-		if (gdalType == GDT_Byte){ return CV_8UC1; }
+		if (gdalType == GDT_Byte){ return CV_8UC3; }
 		if (gdalType == GDT_UInt16){ return CV_16UC3; }
 		if (gdalType == GDT_Int16){ return CV_16SC3; }
 		if (gdalType == GDT_UInt32){ return CV_32SC3; }
@@ -143,10 +162,70 @@ int KGDAL2CV::gdal2opencv(const GDALDataType& gdalType, const int& channels){
 	return -1;
 }
 
+/**
+* Convert opencv depth to gdal type
+*/
+GDALDataType KGDAL2CV::opencv2gdal(const int& cvDepth){
+
+	switch (cvDepth){
+	case CV_8U:  return GDT_Byte;
+	case CV_16U: return GDT_UInt16;
+	case CV_16S: return GDT_Int16;
+	case CV_32S: return GDT_Int32;
+	case CV_32F: return GDT_Float32;
+	case CV_64F: return GDT_Float64;
+	default:     return GDT_Unknown;
+	}
+}
+
+/**
+* Check if range_cast leaves the value untouched, so GDAL can convert the data by itself
+*/
+bool KGDAL2CV::isNativeCast(const GDALDataType& gdalType, const int& cvDepth){
+
+	// uint8 -> uint8
+	if (gdalType == GDT_Byte && cvDepth == CV_8U){
+		return true;
+	}
+
+	// int16 -> int16
+	if ((gdalType == GDT_UInt16 || gdalType == GDT_Int16) &&
+		(cvDepth == CV_16U || cvDepth == CV_16S)){
+		return true;
+	}
+
+	// int32 -> int32, GDAL clamps the uint32 values for us
+	if ((gdalType == GDT_UInt32 || gdalType == GDT_Int32) && cvDepth == CV_32S){
+		return true;
+	}
+
+	// float32 -> float32
+	// float64 -> float64
+	if ((gdalType == GDT_Float32 || gdalType == GDT_Float64) &&
+		(cvDepth == CV_32F || cvDepth == CV_64F)){
+		return true;
+	}
+
+	return false;
+}
+
+/**
+* Check the depth requested for the returned cv::Mat, -1 keeps the depth of the data
+*/
+bool KGDAL2CV::checkDepth(const int& depth){
+
+	if (depth == -1 || opencv2gdal(depth) != GDT_Unknown){
+		return true;
+	}
+	std::cout << "Unsupported depth of the cv::Mat: " << depth << std::endl;
+	return false;
+}
+
 bool KGDAL2CV::readHeader()
 {
-	// load the dataset
-	m_dataset = static_cast<GDALDataset*>(GDALOpen(m_filename.c_str(), GA_ReadOnly));
+	// give back the previous dataset before loading the new one
+	Close();
+	m_dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
 
 	// if dataset is null, then there was a problem
 	if (m_dataset == nullptr){
@@ -219,6 +298,30 @@ bool KGDAL2CV::readHeader()
 	return true;
 }
 
+/**
+* type of the cv::Mat returned for the dataset read by readHeader
+*/
+int KGDAL2CV::outputType(const bool& beReadFourth, const int& depth)
+{
+	int tempType = m_type;
+
+	if (!beReadFourth && 4 == m_nBand)
+	{
+		for (int index = CV_8S; index < CV_USRTYPE1; ++index)
+		{
+			if (CV_MAKETYPE(index, m_nBand) == m_type)
+			{
+				std::cout << "We won't read the fourth band unless it's datatype is GDT_Byte!" << std::endl;
+				tempType = tempType - ((3 << CV_CN_SHIFT) - (2 << CV_CN_SHIFT));
+				break;
+			}
+		}
+	}
+
+	if (depth >= 0) tempType = CV_MAKETYPE(depth, CV_MAT_CN(tempType));
+	return tempType;
+}
+
 bool KGDAL2CV::CheckDataType(const GDALDataType& gdalDataType, cv::Mat img)
 {
 	int TypeMap_GDAL2_0[GDT_TypeCount] = { CV_USRTYPE1, CV_8U, CV_16U, CV_16S, CV_32S, CV_32S, CV_32F, CV_64F, CV_USRTYPE1, CV_USRTYPE1, CV_USRTYPE1, CV_USRTYPE1};
@@ -320,8 +423,11 @@ double KGDAL2CV::range_cast_inv(const GDALDataType& gdalType,
 	return (value);
 }
 
-// be sure the cv::Mat either a gray image or in RGB order!
-bool KGDAL2CV::ImgWriteByGDAL(GDALDataset * dataset, const cv::Mat img, int xStart, int yStart)
+// be sure the cv::Mat either a gray image or in RGB order, unless isBGR is set!
+// the bands are written with a single RasterIO call, the driver only encodes the blocks in parallel
+// with NUM_THREADS: CreateByGDAL sets it, other datasets need NUM_THREADS or GDAL_NUM_THREADS set
+// by the caller
+bool KGDAL2CV::ImgWriteByGDAL(GDALDataset * dataset, const cv::Mat img, int xStart, int yStart, bool isBGR)
 {
 	// if dataset is null, then there was a problem
 	if (dataset == nullptr){
@@ -338,6 +444,10 @@ bool KGDAL2CV::ImgWriteByGDAL(GDALDataset * dataset, const cv::Mat img, int xSta
 		return false;
 	}
 
+	// cached reads of the file would be out of date
+	KGDALDatasetCache::Instance().Invalidate(dataset->GetDescription());
+	KGDALTileCache::Instance().Invalidate(dataset->GetDescription());
+
 	int nBand = dataset->GetRasterCount();
 
 	if (nBand > img.channels())
@@ -376,16 +486,137 @@ bool KGDAL2CV::ImgWriteByGDAL(GDALDataset * dataset, const cv::Mat img, int xSta
 
 	GDALDataType dataType = dataset->GetRasterBand(1)->GetRasterDataType();
 	CheckDataType(dataType, imgToSave);
-	std::vector<cv::Mat> singleMats;
-	int ret = 0;
-	cv::split(imgToSave, singleMats);
-	for (int index = 0; index < nBand; ++index)
+
+	// channel index -> band number, the first three are reversed for a bgr image
+	std::vector<int> bandMap(nBand);
+	for (int index = 0; index < nBand; ++index) bandMap[index] = index + 1;
+	if (isBGR && nBand >= 3)
+	{
+		bandMap[0] = 3;
+		bandMap[2] = 1;
+	}
+
+	// one call, the driver compresses the blocks in parallel itself (GTiff NUM_THREADS)
+	bool ret = writeDatasetNative(dataset, xStart, yStart, imgToSave, bandMap);
+	dataset->FlushCache();
+
+	return ret;
+}
+
+/**
+* write the image with a validity mask (CV_8UC1, 0 for invalid pixels): if the bands have a
+* nodata value the invalid pixels are written with it, otherwise the mask is written into the
+* per dataset mask band, which is created when missing; both happen chunk by chunk with the pixels
+*/
+bool KGDAL2CV::ImgWriteByGDAL(GDALDataset* dataset, const cv::Mat img, const cv::Mat mask, int xStart, int yStart, bool isBGR)
+{
+	if (mask.empty()){
+		return ImgWriteByGDAL(dataset, img, xStart, yStart, isBGR);
+	}
+	if (dataset == nullptr || dataset->GetRasterCount() <= 0){
+		return false;
+	}
+	if (mask.type() != CV_8UC1 || mask.size() != img.size()){
+		std::cout << "The mask should be a CV_8UC1 cv::Mat of the image size!" << std::endl;
+		return false;
+	}
+	if (dataset->GetAccess() == GA_ReadOnly){
+		std::cout << "Invalid access type of the dataset!" << std::endl;
+		return false;
+	}
+
+	// cached reads of the file would be out of date
+	KGDALDatasetCache::Instance().Invalidate(dataset->GetDescription());
+	KGDALTileCache::Instance().Invalidate(dataset->GetDescription());
+
+	int nBand = dataset->GetRasterCount();
+	if (nBand > img.channels())
+	{
+		std::cout << "The channels of GDALDataset shouldn't be more than cv::Mat!" << std::endl;
+		return false;
+	}
+
+	int width = dataset->GetRasterXSize();
+	int height = dataset->GetRasterYSize();
+
+	if (xStart < 0 || yStart < 0 || xStart >= width || yStart >= height)
+	{
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+
+	// the same cut for the image and its mask
+	const cv::Rect area = cv::Rect(0, 0, img.cols, img.rows) & cv::Rect(0, 0, width - xStart, height - yStart);
+	if (area.size() != img.size()){
+		std::cout << "Saved image will be cutted!" << std::endl;
+	}
+	cv::Mat imgToSave = img(area);
+	cv::Mat maskToSave = mask(area);
+
+	GDALDataType dataType = dataset->GetRasterBand(1)->GetRasterDataType();
+	CheckDataType(dataType, imgToSave);
+
+	std::vector<int> bandMap(nBand);
+	for (int index = 0; index < nBand; ++index) bandMap[index] = index + 1;
+	if (isBGR && nBand >= 3)
 	{
-		GDALRasterBand* band = dataset->GetRasterBand(index + 1);
-		ret += (true == ImgWriteByGDAL(band, singleMats[index], xStart, yStart) ? 0 : 1);
+		bandMap[0] = 3;
+		bandMap[2] = 1;
 	}
-	
-	return (0 == ret);
+
+	bool ret = writeMasked(dataset, xStart, yStart, imgToSave, bandMap, maskToSave);
+	dataset->FlushCache();
+
+	return ret;
+}
+
+/**
+* write the channels of the image into the bands of the band map with a single
+* GDALDataset::RasterIO call, the interleaved cv::Mat is handed over as it is
+*/
+bool KGDAL2CV::writeDatasetNative(GDALDataset* dataset, const int& xStart, const int& yStart, const cv::Mat& img, std::vector<int>& bandMap)
+{
+	if (bandMap.empty() || static_cast<int>(bandMap.size()) > img.channels()){
+		return false;
+	}
+
+	cv::Mat imgToSave = img;
+	GDALDataType bufType = opencv2gdal(imgToSave.depth());
+
+	// GDAL has no signed byte, that's the only case we have to convert by ourselves
+	if (bufType == GDT_Unknown){
+		img.convertTo(imgToSave, CV_MAKETYPE(CV_16S, img.channels()));
+		bufType = GDT_Int16;
+	}
+
+	uchar* data = const_cast<uchar*>(imgToSave.ptr<uchar>(0));
+	return CE_None == dataset->RasterIO(GF_Write, xStart, yStart, imgToSave.cols, imgToSave.rows, data, imgToSave.cols, imgToSave.rows, bufType,
+		static_cast<int>(bandMap.size()), &bandMap[0], static_cast<GSpacing>(imgToSave.elemSize()),
+		static_cast<GSpacing>(imgToSave.step[0]), static_cast<GSpacing>(imgToSave.elemSize1()));
+}
+
+/**
+* write one channel of the image into a window of the band, GDAL reads the cv::Mat memory
+* through its strides so no copy is needed for ROIs or channels of interleaved images
+*/
+bool KGDAL2CV::writeBandNative(GDALRasterBand* band, const int& xStart, const int& yStart, const cv::Mat& img, const int& channel)
+{
+	if (channel < 0 || channel >= img.channels()){
+		return false;
+	}
+
+	cv::Mat imgToSave = img;
+	GDALDataType bufType = opencv2gdal(imgToSave.depth());
+
+	// GDAL has no signed byte, that's the only case we have to convert by ourselves
+	if (bufType == GDT_Unknown){
+		img.convertTo(imgToSave, CV_MAKETYPE(CV_16S, img.channels()));
+		bufType = GDT_Int16;
+	}
+
+	uchar* data = const_cast<uchar*>(imgToSave.ptr<uchar>(0)) + channel * imgToSave.elemSize1();
+	return CE_None == band->RasterIO(GF_Write, xStart, yStart, imgToSave.cols, imgToSave.rows, data, imgToSave.cols, imgToSave.rows, bufType,
+		static_cast<GSpacing>(imgToSave.elemSize()), static_cast<GSpacing>(imgToSave.step[0]));
 }
 
 bool KGDAL2CV::ImgWriteByGDAL(GDALRasterBand* pBand, const cv::Mat img, int xStart, int yStart)
@@ -399,13 +630,12 @@ bool KGDAL2CV::ImgWriteByGDAL(GDALRasterBand* pBand, const cv::Mat img, int xSta
 		std::cout << "Invalid access type of the GDALRasterBand!" << std::endl;
 		return false;
 	}
-	cv::Mat imgToSave = img.clone(); 
+	if (pBand->GetDataset() != nullptr){
+		KGDALDatasetCache::Instance().Invalidate(pBand->GetDataset()->GetDescription());
+		KGDALTileCache::Instance().Invalidate(pBand->GetDataset()->GetDescription());
+	}
 	if (img.channels() > 1){
 		std::cout << "More channels of the cv::Mat will be passed!" << std::endl;
-		std::vector<cv::Mat> singleMats;
-		cv::split(img, singleMats);
-		//singleMats[0].copyTo(imgToSave);
-		imgToSave = singleMats[0].clone();
 	}
 
 	int width = pBand->GetXSize();
@@ -416,75 +646,28 @@ bool KGDAL2CV::ImgWriteByGDAL(GDALRasterBand* pBand, const cv::Mat img, int xSta
 		std::cout << "wrong param!" << std::endl;
 		return false;
 	}
-	
+
+	// only the header is copied, the ranges below don't touch the pixels
+	cv::Mat imgToSave = img;
 	int xWidth = imgToSave.cols;
 	int yWidth = imgToSave.rows;
 
 	if (xStart + xWidth > width)
 	{
 		std::cout << "Saved image will be cutted!" << std::endl;
-		imgToSave = (imgToSave.colRange(0, width - xStart)).clone();
+		imgToSave = imgToSave.colRange(0, width - xStart);
 	}
 	if (yStart + yWidth > height)
 	{
 		std::cout << "Saved image will be cutted!" << std::endl;
-		imgToSave = (imgToSave.rowRange(0, height - yStart)).clone();
+		imgToSave = imgToSave.rowRange(0, height - yStart);
 	}
 
 	GDALDataType dataType = pBand->GetRasterDataType();
 	CheckDataType(dataType, imgToSave);
-	
-	xWidth = imgToSave.cols;
-	yWidth = imgToSave.rows;
-	int cvDepth = imgToSave.depth();
-	imgToSave.reshape(1, 1);
-
-	double *imgBuff = new(std::nothrow) double[xWidth * yWidth];
-	if (nullptr == imgBuff) return false;
-
-	if (cvDepth == CV_8S)
-	{
-		char * data = imgToSave.ptr<char>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else if (cvDepth == CV_16U)
-	{
-		unsigned short * data = imgToSave.ptr<unsigned short>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else if (cvDepth == CV_16S)
-	{
-		short * data = imgToSave.ptr<short>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else if (cvDepth == CV_32S)
-	{
-		int * data = imgToSave.ptr<int>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else if (cvDepth == CV_32F)
-	{
-		float * data = imgToSave.ptr<float>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else if (cvDepth == CV_64F)
-	{
-		double * data = imgToSave.ptr<double>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
-	else{
-		unsigned char * data = imgToSave.ptr<unsigned char>(0);
-		for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = static_cast<double>(data[index]);
-	}
 
-	// datatype translate
-	//for (int index = 0; index < xWidth * yWidth; ++index) imgBuff[index] = range_cast_inv(dataType, cvDepth, imgBuff[index]);
-	
-	pBand->RasterIO(GF_Write, xStart, yStart, xWidth, yWidth, imgBuff, xWidth, yWidth, GDT_Float64, 0, 0);
-	pBand->FlushCache();
-
-	delete[] imgBuff;
-	return true;
+	// the data reaches the file when the dataset is flushed or closed
+	return writeBandNative(pBand, xStart, yStart, imgToSave, 0);
 }
 
 /**
@@ -604,456 +787,3778 @@ void KGDAL2CV::write_pixel(const double& pixelValue,
 	}
 }
 
-void KGDAL2CV::write_ctable_pixel(const double& pixelValue,
-	const GDALDataType& gdalType,
-	GDALColorTable const* gdalColorTable,
-	cv::Mat& image,
-	const int& y,
-	const int& x,
-	const int& c){
-
-	if (gdalColorTable == NULL){
-		write_pixel(pixelValue, gdalType, 1, image, y, x, c);
+/**
+* GDAL resampling of RasterIO for the cv::resize interpolation flags
+*/
+static GDALRIOResampleAlg getResampleAlg(const int& interpolation)
+{
+	switch (interpolation){
+	case cv::INTER_NEAREST: return GRIORA_NearestNeighbour;
+	case cv::INTER_CUBIC: return GRIORA_Cubic;
+	case cv::INTER_AREA: return GRIORA_Average;
+	case cv::INTER_LANCZOS4: return GRIORA_Lanczos;
+	default: return GRIORA_Bilinear;
 	}
+}
 
-	// if we are Grayscale, then do a straight conversion
-	if (gdalColorTable->GetPaletteInterpretation() == GPI_Gray){
-		write_pixel(pixelValue, gdalType, 1, image, y, x, c);
+/**
+* read a window of the band straight into one channel of the image, the strides of
+* the cv::Mat let GDAL interleave the data while it is read
+*/
+bool KGDAL2CV::readBandNative(GDALRasterBand* band, const int& xStart, const int& yStart, cv::Mat& img, const int& channel,
+	const cv::Size& source, const int& interpolation)
+{
+	const GDALDataType bufType = opencv2gdal(img.depth());
+	if (bufType == GDT_Unknown || channel < 0 || channel >= img.channels()){
+		return false;
 	}
 
-	// if we are rgb, then convert here
-	else if (gdalColorTable->GetPaletteInterpretation() == GPI_RGB){
+	const cv::Size window = source.area() > 0 ? source : img.size();
+	GDALRasterIOExtraArg extraArg;
+	INIT_RASTERIO_EXTRA_ARG(extraArg);
+	extraArg.eResampleAlg = getResampleAlg(interpolation);
 
-		// get the pixel
-		short r = gdalColorTable->GetColorEntry((int)pixelValue)->c1;
-		short g = gdalColorTable->GetColorEntry((int)pixelValue)->c2;
-		short b = gdalColorTable->GetColorEntry((int)pixelValue)->c3;
-		short a = gdalColorTable->GetColorEntry((int)pixelValue)->c4;
+	uchar* data = img.ptr<uchar>(0) + channel * img.elemSize1();
+	return CE_None == band->RasterIO(GF_Read, xStart, yStart, window.width, window.height, data, img.cols, img.rows, bufType,
+		static_cast<GSpacing>(img.elemSize()), static_cast<GSpacing>(img.step[0]), &extraArg);
+}
 
-		write_pixel(r, gdalType, 4, image, y, x, 2);
-		write_pixel(g, gdalType, 4, image, y, x, 1);
-		write_pixel(b, gdalType, 4, image, y, x, 0);
-		if (image.channels() > 3){
-			write_pixel(a, gdalType, 4, image, y, x, 1);
-		}
+/**
+* map every channel of the image to its band, OpenCV does bgr rather than rgb
+*/
+bool KGDAL2CV::getBandMap(GDALDataset* dataset, const int& channels, std::vector<int>& bandMap)
+{
+	bandMap.assign(channels, 0);
+	if (channels > dataset->GetRasterCount()){
+		return false;
 	}
 
-	// otherwise, set zeros
-	else{
-		write_pixel(pixelValue, gdalType, 1, image, y, x, c);
+	for (int c = 0; c < channels; c++){
+
+		int realBandIndex = c;
+		GDALRasterBand* band = dataset->GetRasterBand(c + 1);
+
+		if (GCI_RedBand == band->GetColorInterpretation()) realBandIndex = 2;
+		if (GCI_GreenBand == band->GetColorInterpretation()) realBandIndex = 1;
+		if (GCI_BlueBand == band->GetColorInterpretation()) realBandIndex = 0;
+
+		// two bands claim the same channel, no single band map exists
+		if (realBandIndex >= channels || bandMap[realBandIndex] != 0){
+			return false;
+		}
+		bandMap[realBandIndex] = c + 1;
 	}
+	return true;
 }
 
 /**
-* read data
+* read a window of all the bands with a single GDALDataset::RasterIO call, every source
+* block is decoded once and interleaved into the image through the band map; when the image
+* is smaller than the window GDAL resamples it, from the best overview if there is one
 */
-bool KGDAL2CV::readData(cv::Mat img){
-	// make sure the image is the proper size
-	if (img.size().height != m_height){
-		return false;
-	}
-	if (img.size().width != m_width){
+bool KGDAL2CV::readDatasetNative(GDALDataset* dataset, const cv::Rect& window, cv::Mat& img, const int& interpolation)
+{
+	const GDALDataType bufType = opencv2gdal(img.depth());
+	if (bufType == GDT_Unknown){
 		return false;
 	}
 
-	// make sure the raster is alive
-	if (m_dataset == NULL || m_driver == NULL){
+	const int nChannels = dataset->GetRasterCount();
+	if (nChannels != img.channels() && !(nChannels == 4 && img.channels() == 3)){
 		return false;
 	}
 
-	// set the image to zero
-	img = 0;
-
-	// iterate over each raster band
-	// note that OpenCV does bgr rather than rgb
-	int nChannels = m_dataset->GetRasterCount();
+	// color tables and range casts are left to the band reader
+	for (int b = 1; b <= img.channels(); b++){
+		GDALRasterBand* band = dataset->GetRasterBand(b);
+		if (band->GetColorInterpretation() == GCI_PaletteIndex ||
+			!isNativeCast(band->GetRasterDataType(), img.depth())){
+			return false;
+		}
+	}
 
-	GDALColorTable* gdalColorTable = NULL;
-	if (m_dataset->GetRasterBand(1)->GetColorTable() != NULL){
-		gdalColorTable = m_dataset->GetRasterBand(1)->GetColorTable();
+	static thread_local std::vector<int> bandMap;
+	if (!getBandMap(dataset, img.channels(), bandMap)){
+		return false;
 	}
 
-	const GDALDataType gdalType = m_dataset->GetRasterBand(1)->GetRasterDataType();
-	int nRows, nCols;
+	GDALRasterIOExtraArg extraArg;
+	INIT_RASTERIO_EXTRA_ARG(extraArg);
+	extraArg.eResampleAlg = getResampleAlg(interpolation);
 
-	//if (nChannels > img.channels()){
-	//	nChannels = img.channels();
-	//}
+	return CE_None == dataset->RasterIO(GF_Read, window.x, window.y, window.width, window.height, img.ptr<uchar>(0), img.cols, img.rows, bufType,
+		img.channels(), &bandMap[0], static_cast<GSpacing>(img.elemSize()), static_cast<GSpacing>(img.step[0]),
+		static_cast<GSpacing>(img.elemSize1()), &extraArg);
+}
 
-	for (int c = 0; c < img.channels(); c++){
+/**
+* The rules of range_cast as compile-time policies, so the kernels below are chosen
+* once per read and run without any branch per pixel
+*/
+struct RangeCastIdentity
+{
+	template<typename D, typename S> static inline D apply(const S& value){ return cv::saturate_cast<D>(value); }
+};
 
-		int realBandIndex = c;
-		
-		// get the GDAL Band
-		GDALRasterBand* band = m_dataset->GetRasterBand(c + 1);
+// uint8 -> uint16
+struct RangeCastMul256
+{
+	template<typename D, typename S> static inline D apply(const S& value){ return cv::saturate_cast<D>(value * 256); }
+};
 
-		//if (hasColorTable == false){
-		if (GCI_RedBand == band->GetColorInterpretation()) realBandIndex = 2;
-		if (GCI_GreenBand == band->GetColorInterpretation()) realBandIndex = 1;
-		if (GCI_BlueBand == band->GetColorInterpretation()) realBandIndex = 0;
-		//}
-		if (hasColorTable && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
-		// make sure the image band has the same dimensions as the image
-		if (band->GetXSize() != m_width || band->GetYSize() != m_height){ return false; }
+// uint8 -> uint32
+struct RangeCastMul16777216
+{
+	template<typename D, typename S> static inline D apply(const S& value){ return cv::saturate_cast<D>(value * 16777216.0); }
+};
 
-		// grab the raster size
-		nRows = band->GetYSize();
-		nCols = band->GetXSize();
+// int16 -> uint8, the shift is a floor division by 256
+struct RangeCastDiv256
+{
+	template<typename D, typename S> static inline D apply(const S& value){ return cv::saturate_cast<D>(value >> 8); }
+};
 
-		// create a temporary scanline pointer to store data
-		double* scanline = new double[nCols];
+/**
+* vectorized part of a row conversion into a contiguous buffer, returns the number of
+* converted values and leaves the tail to the scalar loop
+*/
+template<typename S, typename D, typename Cast>
+struct RowVec
+{
+	enum { enabled = 0 };
+	static int apply(const S*, D*, const int&){ return 0; }
+};
 
-		// iterate over each row and column
-		for (int y = 0; y<nRows; y++){
+#if CV_SIMD128
 
-			// get the entire row
-			band->RasterIO(GF_Read, 0, y, nCols, 1, scanline, nCols, 1, GDT_Float64, 0, 0);
+// the function forms of the arithmetic operators came with OpenCV 4.9, which deprecates the operators
+#if (CV_VERSION_MAJOR < 4) || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR < 9)
+namespace cv
+{
+	template<typename V> static inline V v_mul(const V& a, const V& b){ return a * b; }
+}
+#endif
 
-			// set inside the image
-			for (int x = 0; x<nCols; x++){
+// saturating narrowing of int32 lanes
+static inline void storeNarrow(uchar* dst, const cv::v_int32x4& a, const cv::v_int32x4& b, const cv::v_int32x4& c, const cv::v_int32x4& d)
+{
+	cv::v_store(dst, cv::v_pack_u(cv::v_pack(a, b), cv::v_pack(c, d)));
+}
+static inline void storeNarrow(ushort* dst, const cv::v_int32x4& a, const cv::v_int32x4& b)
+{
+	cv::v_store(dst, cv::v_pack_u(a, b));
+}
+static inline void storeNarrow(short* dst, const cv::v_int32x4& a, const cv::v_int32x4& b)
+{
+	cv::v_store(dst, cv::v_pack(a, b));
+}
 
-				// set depending on image types
-				// given boost, I would use enable_if to speed up.  Avoid for now.
-				if (hasColorTable == false){
-					write_pixel(scanline[x], gdalType, nChannels, img, y, x, realBandIndex);
-				}
-				else{
-					write_ctable_pixel(scanline[x], gdalType, gdalColorTable, img, y, x, c);
-				}
-			}
+// uint16 -> uint8
+template<> struct RowVec<ushort, uchar, RangeCastDiv256>
+{
+	enum { enabled = 1 };
+	static int apply(const ushort* src, uchar* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_store(dst + x, cv::v_pack(cv::v_shr<8>(cv::v_load(src + x)), cv::v_shr<8>(cv::v_load(src + x + 8))));
 		}
-		// delete our temp pointer
-		delete[] scanline;
+		return x;
 	}
+};
 
-	return true;
-}
-
-cv::Mat KGDAL2CV::ImgReadByGDAL(GDALRasterBand* pBand)
+// int16 -> uint8, negative values saturate to 0
+template<> struct RowVec<short, uchar, RangeCastDiv256>
 {
-	m_width = pBand->GetXSize();
-	m_height = pBand->GetYSize();
+	enum { enabled = 1 };
+	static int apply(const short* src, uchar* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_store(dst + x, cv::v_pack_u(cv::v_shr<8>(cv::v_load(src + x)), cv::v_shr<8>(cv::v_load(src + x + 8))));
+		}
+		return x;
+	}
+};
 
-	m_nBand = 1;
-	// check if we have a color palette
-	int tempType;
-	if (pBand->GetColorInterpretation() == GCI_PaletteIndex){
+// uint8 -> uint16
+template<> struct RowVec<uchar, ushort, RangeCastMul256>
+{
+	enum { enabled = 1 };
+	static int apply(const uchar* src, ushort* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_uint16x8 a, b;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_store(dst + x, cv::v_shl<8>(a));
+			cv::v_store(dst + x + 8, cv::v_shl<8>(b));
+		}
+		return x;
+	}
+};
 
-		// remember that we have a color palette
-		hasColorTable = true;
-		// if the color tables does not exist, then we failed
-		if (pBand->GetColorTable() == NULL){
-			return cv::Mat();
+// uint8 -> int16, values above 127 saturate to SHRT_MAX
+template<> struct RowVec<uchar, short, RangeCastMul256>
+{
+	enum { enabled = 1 };
+	static int apply(const uchar* src, short* dst, const int& width)
+	{
+		const cv::v_uint16x8 maxValue = cv::v_setall_u16(SHRT_MAX);
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_uint16x8 a, b;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_store(dst + x, cv::v_reinterpret_as_s16(cv::v_min(cv::v_shl<8>(a), maxValue)));
+			cv::v_store(dst + x + 8, cv::v_reinterpret_as_s16(cv::v_min(cv::v_shl<8>(b), maxValue)));
 		}
-		// otherwise, get the pixeltype
+		return x;
+	}
+};
 
-		// convert the palette interpretation to opencv type
-		tempType = gdalPaletteInterpretation2OpenCV(pBand->GetColorTable()->GetPaletteInterpretation(), pBand->GetRasterDataType());
-
-		if (tempType == -1){
-			return cv::Mat();
+// uint8 -> float32
+template<> struct RowVec<uchar, float, RangeCastMul16777216>
+{
+	enum { enabled = 1 };
+	static int apply(const uchar* src, float* dst, const int& width)
+	{
+		const cv::v_float32x4 scale = cv::v_setall_f32(16777216.f);
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_uint16x8 a, b;
+			cv::v_uint32x4 a0, a1, b0, b1;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_expand(a, a0, a1);
+			cv::v_expand(b, b0, b1);
+			cv::v_store(dst + x, cv::v_mul(cv::v_cvt_f32(cv::v_reinterpret_as_s32(a0)), scale));
+			cv::v_store(dst + x + 4, cv::v_mul(cv::v_cvt_f32(cv::v_reinterpret_as_s32(a1)), scale));
+			cv::v_store(dst + x + 8, cv::v_mul(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b0)), scale));
+			cv::v_store(dst + x + 12, cv::v_mul(cv::v_cvt_f32(cv::v_reinterpret_as_s32(b1)), scale));
 		}
-		m_type = tempType;
+		return x;
 	}
-	// otherwise, we have standard channels
-	else{
-		// remember that we don't have a color table
-		hasColorTable = false;
-		// convert the datatype to opencv
-		tempType = gdal2opencv(pBand->GetRasterDataType(), m_nBand);
-		if (tempType == -1){
-			return cv::Mat();
+};
+
+// uint8 -> int32, values above 127 saturate to INT_MAX
+template<> struct RowVec<uchar, int, RangeCastMul16777216>
+{
+	enum { enabled = 1 };
+	static int apply(const uchar* src, int* dst, const int& width)
+	{
+		const cv::v_uint32x4 maxValue = cv::v_setall_u32(INT_MAX);
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			cv::v_uint16x8 a, b;
+			cv::v_uint32x4 a0, a1, b0, b1;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_expand(a, a0, a1);
+			cv::v_expand(b, b0, b1);
+			cv::v_store(dst + x, cv::v_reinterpret_as_s32(cv::v_min(cv::v_shl<24>(a0), maxValue)));
+			cv::v_store(dst + x + 4, cv::v_reinterpret_as_s32(cv::v_min(cv::v_shl<24>(a1), maxValue)));
+			cv::v_store(dst + x + 8, cv::v_reinterpret_as_s32(cv::v_min(cv::v_shl<24>(b0), maxValue)));
+			cv::v_store(dst + x + 12, cv::v_reinterpret_as_s32(cv::v_min(cv::v_shl<24>(b1), maxValue)));
 		}
-		m_type = tempType;
+		return x;
 	}
+};
 
-	cv::Mat img(m_height, m_width, m_type, cv::Scalar::all(0.f));
+// uint16 -> float32
+template<> struct RowVec<ushort, float, RangeCastIdentity>
+{
+	enum { enabled = 1 };
+	static int apply(const ushort* src, float* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 8; x += 8){
+			cv::v_uint32x4 a, b;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_store(dst + x, cv::v_cvt_f32(cv::v_reinterpret_as_s32(a)));
+			cv::v_store(dst + x + 4, cv::v_cvt_f32(cv::v_reinterpret_as_s32(b)));
+		}
+		return x;
+	}
+};
 
-	// iterate over each raster band
-	// note that OpenCV does bgr rather than rgb
-	GDALColorTable* gdalColorTable = NULL;
-	if (pBand->GetColorTable() != NULL){
-		gdalColorTable = pBand->GetColorTable();
+// int16 -> float32
+template<> struct RowVec<short, float, RangeCastIdentity>
+{
+	enum { enabled = 1 };
+	static int apply(const short* src, float* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 8; x += 8){
+			cv::v_int32x4 a, b;
+			cv::v_expand(cv::v_load(src + x), a, b);
+			cv::v_store(dst + x, cv::v_cvt_f32(a));
+			cv::v_store(dst + x + 4, cv::v_cvt_f32(b));
+		}
+		return x;
 	}
+};
 
-	const GDALDataType gdalType = pBand->GetRasterDataType();
-	int nRows, nCols;
+// int32 -> uint8
+template<> struct RowVec<int, uchar, RangeCastIdentity>
+{
+	enum { enabled = 1 };
+	static int apply(const int* src, uchar* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			storeNarrow(dst + x, cv::v_load(src + x), cv::v_load(src + x + 4), cv::v_load(src + x + 8), cv::v_load(src + x + 12));
+		}
+		return x;
+	}
+};
 
-	//if (m_nBand > img.channels()){
-	//	m_nBand = img.channels();
-	//}
+// int32 -> uint16 / int16
+template<typename D> struct RowVecInt32Narrow
+{
+	enum { enabled = 1 };
+	static int apply(const int* src, D* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 8; x += 8){
+			storeNarrow(dst + x, cv::v_load(src + x), cv::v_load(src + x + 4));
+		}
+		return x;
+	}
+};
+template<> struct RowVec<int, ushort, RangeCastIdentity> : public RowVecInt32Narrow<ushort> {};
+template<> struct RowVec<int, short, RangeCastIdentity> : public RowVecInt32Narrow<short> {};
 
-	for (int c = 0; c < img.channels(); c++){
-		// grab the raster size
-		nRows = pBand->GetYSize();
-		nCols = pBand->GetXSize();
+// float32 -> uint8, rounded like cv::saturate_cast
+template<> struct RowVec<float, uchar, RangeCastIdentity>
+{
+	enum { enabled = 1 };
+	static int apply(const float* src, uchar* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 16; x += 16){
+			storeNarrow(dst + x, cv::v_round(cv::v_load(src + x)), cv::v_round(cv::v_load(src + x + 4)),
+				cv::v_round(cv::v_load(src + x + 8)), cv::v_round(cv::v_load(src + x + 12)));
+		}
+		return x;
+	}
+};
 
-		if (hasColorTable && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
-		// create a temporary scanline pointer to store data
-		double* scanline = new double[nCols];
+// float32 -> uint16 / int16
+template<typename D> struct RowVecFloatNarrow
+{
+	enum { enabled = 1 };
+	static int apply(const float* src, D* dst, const int& width)
+	{
+		int x = 0;
+		for (; x <= width - 8; x += 8){
+			storeNarrow(dst + x, cv::v_round(cv::v_load(src + x)), cv::v_round(cv::v_load(src + x + 4)));
+		}
+		return x;
+	}
+};
+template<> struct RowVec<float, ushort, RangeCastIdentity> : public RowVecFloatNarrow<ushort> {};
+template<> struct RowVec<float, short, RangeCastIdentity> : public RowVecFloatNarrow<short> {};
 
-		// iterate over each row and column
-		for (int y = 0; y<nRows; y++){
+#endif
 
-			// get the entire row
-			pBand->RasterIO(GF_Read, 0, y, nCols, 1, scanline, nCols, 1, GDT_Float64, 0, 0);
+typedef void(*RowConverter)(const void*, uchar*, const int&, const int&);
 
-			// set inside the image
-			for (int x = 0; x<nCols; x++){
+// values converted at once before they are scattered into an interleaved image
+static const int VEC_CHUNK = 256;
 
-				// set depending on image types
-				// given boost, I would use enable_if to speed up.  Avoid for now.
-				if (hasColorTable == false){
-					write_pixel(scanline[x], gdalType, m_nBand, img, y, x, c);
+/**
+* convert a row of one band into one channel of the image, CN == 0 means the channel
+* count is only known at runtime
+*/
+template<typename S, typename D, typename Cast, int CN>
+static void convertRow(const void* src, uchar* dst, const int& width, const int& channels)
+{
+	const S* srcData = static_cast<const S*>(src);
+	D* dstData = reinterpret_cast<D*>(dst);
+	const int step = CN > 0 ? CN : channels;
+	int x = 0;
+
+	if (RowVec<S, D, Cast>::enabled){
+		if (step == 1){
+			x = RowVec<S, D, Cast>::apply(srcData, dstData, width);
+			dstData += x;
+		}
+		else{
+			// convert a chunk with the vector kernel, then interleave it
+			D buffer[VEC_CHUNK];
+			while (x < width){
+				const int n = RowVec<S, D, Cast>::apply(srcData + x, buffer, std::min(VEC_CHUNK, width - x));
+				if (n == 0){
+					break;
 				}
-				else{
-					write_ctable_pixel(scanline[x], gdalType, gdalColorTable, img, y, x, c);
+				for (int i = 0; i < n; i++, dstData += step){
+					*dstData = buffer[i];
 				}
+				x += n;
 			}
 		}
-		// delete our temp pointer
-		delete[] scanline;
 	}
 
-	return img;
+	for (; x < width; x++, dstData += step){
+		*dstData = Cast::template apply<D>(srcData[x]);
+	}
 }
 
-cv::Mat KGDAL2CV::ImgReadByGDAL(cv::String filename, int xStart, int yStart, int xWidth, int yWidth, bool beReadFourth)
+template<typename S, typename D, typename Cast>
+static RowConverter getRowConverter(const int& channels)
 {
-	m_filename = filename;
-	if (!readHeader()) return cv::Mat();
-	
-	int tempType = m_type;
+	switch (channels){
+	case 1:  return convertRow<S, D, Cast, 1>;
+	case 3:  return convertRow<S, D, Cast, 3>;
+	case 4:  return convertRow<S, D, Cast, 4>;
+	default: return convertRow<S, D, Cast, 0>;
+	}
+}
 
-	if (xStart < 0 || yStart < 0 || xWidth < 1 || yWidth < 1 || xStart > m_width - 1 || yStart > m_height - 1) return cv::Mat();
+template<typename D>
+static RowConverter getRowConverter(const GDALDataType& gdalType, const int& cvDepth, const int& channels)
+{
+	switch (gdalType){
+	case GDT_Byte:
+		if (cvDepth == CV_16U || cvDepth == CV_16S){ return getRowConverter<uchar, D, RangeCastMul256>(channels); }
+		if (cvDepth == CV_32F || cvDepth == CV_32S){ return getRowConverter<uchar, D, RangeCastMul16777216>(channels); }
+		return getRowConverter<uchar, D, RangeCastIdentity>(channels);
 
-	if (xStart + xWidth > m_width)
-	{
-		std::cout << "The specified width is invalid, Automatic optimization is executed!" << std::endl;
-		xWidth = m_width - xStart;
-	}
+	case GDT_UInt16:
+		if (cvDepth == CV_8U){ return getRowConverter<ushort, D, RangeCastDiv256>(channels); }
+		return getRowConverter<ushort, D, RangeCastIdentity>(channels);
 
-	if (yStart + yWidth > m_height)
-	{
-		std::cout << "The specified height is invalid, Automatic optimization is executed!" << std::endl;
-		yWidth = m_height - yStart;
+	case GDT_Int16:
+		if (cvDepth == CV_8U){ return getRowConverter<short, D, RangeCastDiv256>(channels); }
+		return getRowConverter<short, D, RangeCastIdentity>(channels);
+
+	case GDT_UInt32: return getRowConverter<unsigned int, D, RangeCastIdentity>(channels);
+	case GDT_Int32:  return getRowConverter<int, D, RangeCastIdentity>(channels);
+	case GDT_Float32: return getRowConverter<float, D, RangeCastIdentity>(channels);
+	case GDT_Float64: return getRowConverter<double, D, RangeCastIdentity>(channels);
+	default: return NULL;
 	}
+}
 
-	if (!beReadFourth && 4 == m_nBand)
-	{
-		for (unsigned int index = CV_8S; index < CV_USRTYPE1; ++index)
-		{
-			if (CV_MAKETYPE(index, m_nBand) == m_type)
-			{
-				std::cout << "We won't read the fourth band unless it's datatype is GDT_Byte!" << std::endl;
-				//tempType = -1;
-				tempType = tempType - ((3 << CV_CN_SHIFT) - (2 << CV_CN_SHIFT));
-				break;
-				//tempType = CV_MAKETYPE(index, m_nBand);
-			}
-		}
+/**
+* pick the kernel for a (GDALDataType, cv depth, channel count)
+*/
+static RowConverter getRowConverter(const GDALDataType& gdalType, const int& cvDepth, const int& channels)
+{
+	switch (cvDepth){
+	case CV_8U:  return getRowConverter<uchar>(gdalType, cvDepth, channels);
+	case CV_16U: return getRowConverter<ushort>(gdalType, cvDepth, channels);
+	case CV_16S: return getRowConverter<short>(gdalType, cvDepth, channels);
+	case CV_32S: return getRowConverter<int>(gdalType, cvDepth, channels);
+	case CV_32F: return getRowConverter<float>(gdalType, cvDepth, channels);
+	case CV_64F: return getRowConverter<double>(gdalType, cvDepth, channels);
+	default: return NULL;
 	}
+}
 
-	cv::Mat img(yWidth, xWidth, tempType, cv::Scalar::all(0.f));
-	// iterate over each raster band
-	// note that OpenCV does bgr rather than rgb
-	int nChannels = m_dataset->GetRasterCount();
+// upper bound of the native buffer used while converting
+static const size_t MAX_STRIP_BYTES = 16 << 20;
 
-	GDALColorTable* gdalColorTable = NULL;
-	if (m_dataset->GetRasterBand(1)->GetColorTable() != NULL){
-		gdalColorTable = m_dataset->GetRasterBand(1)->GetColorTable();
+// slots of the scratch memory, so the buffers of one read don't overwrite each other
+enum { SCRATCH_STRIP, SCRATCH_TABLE, SCRATCH_COLORS, SCRATCH_MASK, SCRATCH_VALID, SCRATCH_SLOTS };
+
+/**
+* scratch memory of the calling thread that grows to the largest request and is kept,
+* steady-state reads don't allocate; thread local so the parallel readers share nothing
+*/
+static uchar* getScratch(const int& slot, const size_t& bytes)
+{
+	static thread_local std::vector<uchar> scratch[SCRATCH_SLOTS];
+	if (scratch[slot].size() < bytes) scratch[slot].resize(bytes);
+	return scratch[slot].data();
+}
+
+/**
+* read a window of the band as bufType strip by strip, as long as the strips fit into the buffer,
+* and hand every row to convert(row, y); a window larger than size is resampled by GDAL in a
+* single read, so only size pixels are ever held
+*/
+template<typename Convert>
+static bool readBandStrips(GDALRasterBand* band, const cv::Rect& window, const cv::Size& size, const GDALDataType& bufType, const int& interpolation, Convert convert)
+{
+	const int nCols = size.width;
+	const size_t rowBytes = static_cast<size_t>(nCols) * (GDALGetDataTypeSize(bufType) / 8);
+
+	if (window.size() != size){
+		GDALRasterIOExtraArg extraArg;
+		INIT_RASTERIO_EXTRA_ARG(extraArg);
+		extraArg.eResampleAlg = getResampleAlg(interpolation);
+
+		uchar* buffer = getScratch(SCRATCH_STRIP, size.height * rowBytes);
+		if (band->RasterIO(GF_Read, window.x, window.y, window.width, window.height, buffer, nCols, size.height, bufType, 0, 0, &extraArg) != CE_None){
+			return false;
+		}
+		for (int y = 0; y < size.height; y++){
+			convert(&buffer[y * rowBytes], y);
+		}
+		return true;
 	}
 
-	const GDALDataType gdalType = m_dataset->GetRasterBand(1)->GetRasterDataType();
+	// strips follow the blocks of the band
+	int blockXSize, blockYSize;
+	band->GetBlockSize(&blockXSize, &blockYSize);
+	int stripRows = std::max(1, std::min(blockYSize, size.height));
+	stripRows = std::max(1, std::min(stripRows, static_cast<int>(MAX_STRIP_BYTES / rowBytes)));
 
-	//if (nChannels > img.channels()){
-	//	nChannels = img.channels();
-	//}
-	for (int c = 0; c < img.channels(); c++){
+	uchar* strip = getScratch(SCRATCH_STRIP, stripRows * rowBytes);
 
-		int realBandIndex = c;
+	for (int y = 0; y < size.height;){
 
-		// get the GDAL Band
-		GDALRasterBand* band = m_dataset->GetRasterBand(c + 1);
+		// stop at the next block boundary, so no block is decoded twice
+		int nRows = std::min(stripRows, size.height - y);
+		if (stripRows > 1 && blockYSize > 0){
+			nRows = std::min(nRows, blockYSize - (window.y + y) % blockYSize);
+		}
 
-		//if (hasColorTable == false){
-		if (GCI_RedBand == band->GetColorInterpretation()) realBandIndex = 2;
-		if (GCI_GreenBand == band->GetColorInterpretation()) realBandIndex = 1;
-		if (GCI_BlueBand == band->GetColorInterpretation()) realBandIndex = 0;
-		//}
-		if (hasColorTable && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
-		// make sure the image band has the same dimensions as the image
-		if (band->GetXSize() != m_width || band->GetYSize() != m_height){ return cv::Mat(); }
-
-		// create a temporary scanline pointer to store data
-		double* scanline = new double[xWidth];
-
-		// iterate over each row and column
-		for (int y = 0; y<yWidth; y++){
-
-			// get the entire row
-			band->RasterIO(GF_Read, xStart, y + yStart, xWidth, 1, scanline, xWidth, 1, GDT_Float64, 0, 0);
-			// set inside the image
-			for (int x = 0; x<xWidth; x++){
-				// set depending on image types
-				// given boost, I would use enable_if to speed up.  Avoid for now.
-				if (hasColorTable == false){
-					write_pixel(scanline[x], gdalType, nChannels, img, y, x, realBandIndex);
-				}
-				else{
-					write_ctable_pixel(scanline[x], gdalType, gdalColorTable, img, y, x, c);
-				}
-			}
+		if (band->RasterIO(GF_Read, window.x, window.y + y, nCols, nRows, strip, nCols, nRows, bufType, 0, 0) != CE_None){
+			return false;
 		}
-		// delete our temp pointer
-		delete[] scanline;
+
+		for (int r = 0; r < nRows; r++){
+			convert(&strip[r * rowBytes], y + r);
+		}
+		y += nRows;
 	}
-	return img;
+	return true;
 }
 
-cv::Mat KGDAL2CV::ImgReadByGDAL(GDALRasterBand* pBand, int xStart, int yStart, int xWidth, int yWidth)
+/**
+* read a window of the band and range cast it into one channel of the image
+*/
+bool KGDAL2CV::readBandConvert(GDALRasterBand* band, const int& xStart, const int& yStart, cv::Mat& img, const int& channel,
+	const cv::Size& source, const int& interpolation)
 {
-	m_width = pBand->GetXSize();
-	m_height = pBand->GetYSize();
+	RowConverter convert = getRowConverter(band->GetRasterDataType(), img.depth(), img.channels());
+	if (convert == NULL || channel < 0 || channel >= img.channels()){
+		return false;
+	}
 
-	m_nBand = 1;
-	// check if we have a color palette
-	int tempType;
-	if (pBand->GetColorInterpretation() == GCI_PaletteIndex){
+	const cv::Rect window(cv::Point(xStart, yStart), source.area() > 0 ? source : img.size());
+	const size_t offset = channel * img.elemSize1();
+	return readBandStrips(band, window, img.size(), band->GetRasterDataType(), interpolation, [&](const uchar* row, const int& y){
+		convert(row, img.ptr<uchar>(y) + offset, img.cols, img.channels());
+	});
+}
 
-		// remember that we have a color palette
-		hasColorTable = true;
-		// if the color tables does not exist, then we failed
-		if (pBand->GetColorTable() == NULL){
-			return cv::Mat();
-		}
-		// otherwise, get the pixeltype
+/**
+* linear stretch of band values to [0, range] followed by the gamma curve
+*/
+struct StretchMap
+{
+	double low;
+	double scale;
+	double invGamma;
+	double range;
 
-		// convert the palette interpretation to opencv type
-		tempType = gdalPaletteInterpretation2OpenCV(pBand->GetColorTable()->GetPaletteInterpretation(), pBand->GetRasterDataType());
+	StretchMap(const double& low, const double& high, const double& gamma, const double& range)
+		: low(low), scale(high > low ? 1.0 / (high - low) : 0), invGamma(gamma > 0 ? 1.0 / gamma : 1), range(range){}
 
-		if (tempType == -1){
-			return cv::Mat();
-		}
-		m_type = tempType;
+	inline double apply(const double& value) const
+	{
+		// NaN ends up at 0 as well
+		double t = (value - low) * scale;
+		t = t > 0 ? (t < 1 ? t : 1) : 0;
+		if (invGamma != 1) t = std::pow(t, invGamma);
+		return t * range;
 	}
-	// otherwise, we have standard channels
-	else{
-		// remember that we don't have a color table
-		hasColorTable = false;
-		// convert the datatype to opencv
-		tempType = gdal2opencv(pBand->GetRasterDataType(), m_nBand);
-		if (tempType == -1){
-			return cv::Mat();
+};
+
+typedef void(*StretchRow)(const void*, const StretchMap&, const uchar*, uchar*, const int&, const int&);
+typedef void(*StretchTable)(const StretchMap&, uchar*);
+
+/**
+* the stretched value of every value of an 8 or 16 bit type, indexed by value - min
+*/
+template<typename S, typename D>
+static void stretchTable(const StretchMap& map, uchar* table)
+{
+	D* lut = reinterpret_cast<D*>(table);
+	const int minValue = std::numeric_limits<S>::min();
+	const int count = std::numeric_limits<S>::max() - minValue + 1;
+	for (int i = 0; i < count; i++){
+		lut[i] = cv::saturate_cast<D>(map.apply(i + minValue));
+	}
+}
+
+/**
+* stretch a row of one band into one channel of the image, through the table if there is one
+*/
+template<typename S, typename D>
+static void stretchRow(const void* src, const StretchMap& map, const uchar* table, uchar* dst, const int& width, const int& channels)
+{
+	const S* srcData = static_cast<const S*>(src);
+	D* dstData = reinterpret_cast<D*>(dst);
+
+	if (table != nullptr){
+		const D* lut = reinterpret_cast<const D*>(table);
+		const int offset = -static_cast<int>(std::numeric_limits<S>::min());
+		for (int x = 0; x < width; x++, dstData += channels){
+			*dstData = lut[static_cast<int>(srcData[x]) + offset];
 		}
-		m_type = tempType;
+		return;
 	}
 
-	if (xStart < 0 || yStart < 0 || xWidth < 1 || yWidth < 1 || xStart > m_width - 1 || yStart > m_height - 1) return cv::Mat();
+	for (int x = 0; x < width; x++, dstData += channels){
+		*dstData = cv::saturate_cast<D>(map.apply(static_cast<double>(srcData[x])));
+	}
+}
 
-	if (xStart + xWidth > m_width)
-	{
-		std::cout << "The specified width is invalid, Automatic optimization is executed!" << std::endl;
-		xWidth = m_width - xStart;
+/**
+* pick the stretch kernel for a GDALDataType, types of at most 16 bits get a lookup table
+*/
+template<typename D>
+static bool getStretchKernel(const GDALDataType& gdalType, StretchRow& row, StretchTable& table, size_t& tableSize)
+{
+	table = nullptr;
+	tableSize = 0;
+
+	switch (gdalType){
+	case GDT_Byte:    row = stretchRow<uchar, D>; table = stretchTable<uchar, D>; tableSize = 256; return true;
+	case GDT_UInt16:  row = stretchRow<ushort, D>; table = stretchTable<ushort, D>; tableSize = 65536; return true;
+	case GDT_Int16:   row = stretchRow<short, D>; table = stretchTable<short, D>; tableSize = 65536; return true;
+	case GDT_UInt32:  row = stretchRow<unsigned int, D>; return true;
+	case GDT_Int32:   row = stretchRow<int, D>; return true;
+	case GDT_Float32: row = stretchRow<float, D>; return true;
+	case GDT_Float64: row = stretchRow<double, D>; return true;
+	default: return false;
 	}
+}
 
-	if (yStart + yWidth > m_height)
-	{
-		std::cout << "The specified height is invalid, Automatic optimization is executed!" << std::endl;
-		yWidth = m_height - yStart;
+/**
+* read a window of the band and stretch it into one channel of an 8 bit or float image,
+* in the same pass that converts it from the native type
+*/
+bool KGDAL2CV::readBandStretch(GDALRasterBand* band, const int& xStart, const int& yStart, cv::Mat& img, const int& channel,
+	const double& low, const double& high, const double& gamma)
+{
+	StretchRow stretch = nullptr;
+	StretchTable buildTable = nullptr;
+	size_t tableSize = 0;
+
+	const GDALDataType gdalType = band->GetRasterDataType();
+	const bool found = img.depth() == CV_8U ? getStretchKernel<uchar>(gdalType, stretch, buildTable, tableSize) :
+		img.depth() == CV_32F && getStretchKernel<float>(gdalType, stretch, buildTable, tableSize);
+	if (!found || channel < 0 || channel >= img.channels()){
+		return false;
 	}
 
-	cv::Mat img(yWidth, xWidth, m_type, cv::Scalar::all(0.f));
+	const StretchMap map(low, high, gamma, img.depth() == CV_8U ? 255 : 1);
 
-	// iterate over each raster band
-	// note that OpenCV does bgr rather than rgb
-	GDALColorTable* gdalColorTable = NULL;
-	if (pBand->GetColorTable() != NULL){
-		gdalColorTable = pBand->GetColorTable();
+	// the table only pays off once the window has more pixels than the table has entries
+	uchar* table = nullptr;
+	if (buildTable != nullptr && img.total() >= tableSize){
+		table = getScratch(SCRATCH_TABLE, tableSize * img.elemSize1());
+		buildTable(map, table);
 	}
 
-	const GDALDataType gdalType = pBand->GetRasterDataType();
+	const size_t offset = channel * img.elemSize1();
+	return readBandStrips(band, cv::Rect(xStart, yStart, img.cols, img.rows), img.size(), gdalType, cv::INTER_NEAREST, [&](const uchar* row, const int& y){
+		stretch(row, map, table, img.ptr<uchar>(y) + offset, img.cols, img.channels());
+	});
+}
 
-	//if (m_nBand > img.channels()){
-	//	m_nBand = img.channels();
-	//}
+/**
+* expand a row of palette indices through the lookup table, one entry of CN values per index
+*/
+template<typename I, typename T, int CN>
+static void expandPaletteRow(const void* src, const uchar* table, uchar* dst, const int& width)
+{
+	const I* index = static_cast<const I*>(src);
+	const T* lut = reinterpret_cast<const T*>(table);
+	T* out = reinterpret_cast<T*>(dst);
 
-	for (int c = 0; c < img.channels(); c++){
-		// grab the raster size
+	for (int x = 0; x < width; x++, out += CN){
+		const T* entry = lut + index[x] * CN;
+		for (int c = 0; c < CN; c++) out[c] = entry[c];
+	}
+}
 
-		if (hasColorTable && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
-		// create a temporary scanline pointer to store data
-		double* scanline = new double[xWidth];
+typedef void(*PaletteExpander)(const void*, const uchar*, uchar*, const int&);
 
-		// iterate over each row and column
-		for (int y = 0; y<yWidth; y++){
+template<typename I, typename T>
+static PaletteExpander getPaletteExpander(const int& channels)
+{
+	switch (channels){
+	case 1: return expandPaletteRow<I, T, 1>;
+	case 3: return expandPaletteRow<I, T, 3>;
+	case 4: return expandPaletteRow<I, T, 4>;
+	default: return NULL;
+	}
+}
 
-			// get the entire row
-			pBand->RasterIO(GF_Read, xStart, y + yStart, xWidth, 1, scanline, xWidth, 1, GDT_Float64, 0, 0);
+template<typename I>
+static PaletteExpander getPaletteExpander(const int& cvDepth, const int& channels)
+{
+	switch (cvDepth){
+	case CV_8U:  return getPaletteExpander<I, uchar>(channels);
+	case CV_8S:  return getPaletteExpander<I, schar>(channels);
+	case CV_16U: return getPaletteExpander<I, ushort>(channels);
+	case CV_16S: return getPaletteExpander<I, short>(channels);
+	case CV_32S: return getPaletteExpander<I, int>(channels);
+	case CV_32F: return getPaletteExpander<I, float>(channels);
+	case CV_64F: return getPaletteExpander<I, double>(channels);
+	default:     return NULL;
+	}
+}
 
-			// set inside the image
-			for (int x = 0; x<xWidth; x++){
-				// set depending on image types
-				// given boost, I would use enable_if to speed up.  Avoid for now.
-				if (hasColorTable == false){
-					write_pixel(scanline[x], gdalType, m_nBand, img, y, x, c);
-				}
-				else{
-					write_ctable_pixel(scanline[x], gdalType, gdalColorTable, img, y, x, c);
-				}
+/**
+* read a window of a palette band, the color table is turned once into a lookup table of
+* bgr(a) or gray entries at the image type and every strip of indices is expanded through it
+*/
+bool KGDAL2CV::readBandPalette(GDALRasterBand* band, GDALColorTable const* gdalColorTable, const int& xStart, const int& yStart, cv::Mat& img,
+	const cv::Size& source)
+{
+	const GDALPaletteInterp interp = gdalColorTable->GetPaletteInterpretation();
+	if (interp != GPI_Gray && interp != GPI_RGB){
+		return false;
+	}
+
+	// byte indices need 256 entries, anything else is read as uint16 with 65536 entries
+	const GDALDataType gdalType = band->GetRasterDataType();
+	const GDALDataType indexType = gdalType == GDT_Byte ? GDT_Byte : GDT_UInt16;
+	const int nEntries = indexType == GDT_Byte ? 256 : 65536;
+
+	const int channels = img.channels();
+	PaletteExpander expand = indexType == GDT_Byte ? getPaletteExpander<uchar>(img.depth(), channels) :
+		getPaletteExpander<ushort>(img.depth(), channels);
+	if (expand == NULL){
+		return false;
+	}
+
+	// indices without a color entry stay zero
+	const int nColors = std::min(nEntries, gdalColorTable->GetColorEntryCount());
+	cv::Mat table(1, nEntries, img.type(), getScratch(SCRATCH_TABLE, nEntries * img.elemSize()));
+	table = cv::Scalar::all(0);
+	if (nColors > 0){
+		cv::Mat colors(1, nColors, CV_64FC(channels), getScratch(SCRATCH_COLORS, nColors * channels * sizeof(double)));
+		for (int i = 0; i < nColors; i++){
+			const GDALColorEntry* entry = gdalColorTable->GetColorEntry(i);
+			double* value = colors.ptr<double>(0) + i * channels;
+
+			if (interp == GPI_Gray){
+				for (int c = 0; c < channels; c++) value[c] = range_cast(gdalType, img.depth(), entry->c1);
+			}
+			else{
+				const double bgra[4] = { static_cast<double>(entry->c3), static_cast<double>(entry->c2),
+					static_cast<double>(entry->c1), static_cast<double>(entry->c4) };
+				for (int c = 0; c < channels; c++) value[c] = range_cast(gdalType, img.depth(), channels == 1 ? entry->c1 : bgra[c]);
 			}
 		}
-		// delete our temp pointer
-		delete[] scanline;
+		cv::Mat known = table.colRange(0, nColors);
+		colors.convertTo(known, img.depth());
 	}
 
-	return img;
+	// averaged indices are meaningless, a smaller image picks the nearest ones
+	const cv::Rect window(cv::Point(xStart, yStart), source.area() > 0 ? source : img.size());
+	return readBandStrips(band, window, img.size(), indexType, cv::INTER_NEAREST, [&](const uchar* row, const int& y){
+		expand(row, table.ptr<uchar>(0), img.ptr<uchar>(y), img.cols);
+	});
 }
 
-cv::Mat KGDAL2CV::ImgReadByGDAL(cv::String filename, bool beReadFourth)
-{
-	m_filename = filename;
-	if (!readHeader()) return cv::Mat();
-	
-	int tempType = m_type;
+/**
+* read a window of the band into the given channel of the image, the window has the size of the image
+* unless a source size is given, then GDAL resamples it to the image while reading
+*/
+bool KGDAL2CV::readBand(GDALRasterBand* band,
+	const int& gdalChannels,
+	GDALColorTable const* gdalColorTable,
+	const int& xStart,
+	const int& yStart,
+	cv::Mat& img,
+	const int& channel,
+	const cv::Size& source,
+	const int& interpolation){
+
+	const GDALDataType gdalType = band->GetRasterDataType();
+
+	// color tables are expanded through a lookup table, all the channels at once
+	if (gdalColorTable != NULL){
+		return readBandPalette(band, gdalColorTable, xStart, yStart, img, source);
+	}
 
-	if (!beReadFourth && 4 == m_nBand)
-	{
-		for (unsigned int index = CV_8S; index < CV_USRTYPE1; ++index)
-		{
-			if (CV_MAKETYPE(index, m_nBand) == m_type)
-			{
-				std::cout << "We won't read the fourth band unless it's datatype is GDT_Byte!" << std::endl;
-				//tempType = -1;
-				tempType = tempType - ((3 << CV_CN_SHIFT) - (2 << CV_CN_SHIFT));
-				break;
-				//tempType = CV_MAKETYPE(index, m_nBand);
-			}
+	if (gdalChannels == img.channels() || (gdalChannels == 4 && img.channels() == 3)){
+
+		// no range cast is needed, skip the double scanline
+		if (isNativeCast(gdalType, img.depth())){
+			return readBandNative(band, xStart, yStart, img, channel, source, interpolation);
+		}
+
+		// otherwise range cast with a kernel chosen once for the whole band
+		if (readBandConvert(band, xStart, yStart, img, channel, source, interpolation)){
+			return true;
 		}
 	}
 
-	cv::Mat img(m_height, m_width, tempType, cv::Scalar::all(0.f));
-	//if (-1 == tempType) tempType = m_type - ((3 << CV_CN_SHIFT) - (2 << CV_CN_SHIFT));
-	//img.create(m_height, m_width, tempType);
-	if (!readData(img)) img.release(); 
-	//cv::cvtColor(img, img, CV_RGB2BGR);
-	return img;
-}
+	// the pixel by pixel path below doesn't resample
+	if (source.area() > 0 && source != img.size()){
+		return false;
+	}
 
-void KGDAL2CV::Close()
-{
-	if (nullptr != m_dataset) GDALClose(static_cast<GDALDatasetH>(m_dataset));
-	m_dataset = nullptr;
-	m_driver = nullptr;
+	// the remaining channel layouts go pixel by pixel
+	const int nRows = img.rows;
+	const int nCols = img.cols;
+
+	double* scanline = reinterpret_cast<double*>(getScratch(SCRATCH_STRIP, nCols * sizeof(double)));
+
+	// iterate over each row and column
+	for (int y = 0; y<nRows; y++){
+
+		// get the entire row
+		if (band->RasterIO(GF_Read, xStart, yStart + y, nCols, 1, scanline, nCols, 1, GDT_Float64, 0, 0) != CE_None){
+			return false;
+		}
+
+		// set inside the image
+		for (int x = 0; x<nCols; x++){
+
+			write_pixel(scanline[x], gdalType, gdalChannels, img, y, x, channel);
+		}
+	}
+	return true;
 }
 
-KGDAL2CV::KGDAL2CV() : m_dataset(nullptr), m_filename(""), m_driver(nullptr), hasColorTable(false), m_width(0), m_height(0), m_type(-1), m_nBand(0)
+/**
+* band of the dataset or one of its overviews
+*/
+static GDALRasterBand* getBand(GDALDataset* dataset, const int& index, const int& overview)
 {
-	GDALAllRegister();
-	CPLSetConfigOption("GDAL_FILENAME_IS_UTF8", "NO");
+	GDALRasterBand* band = dataset->GetRasterBand(index);
+	return (band == nullptr || overview < 0) ? band : band->GetOverview(overview);
 }
 
-KGDAL2CV::~KGDAL2CV()
+/**
+* read the window of the dataset starting at (xStart, yStart) into img, the window has the size of the image;
+* with an overview index the window is read from that overview of every band; with a source size
+* the window has that size and GDAL resamples it to the image
+*/
+bool KGDAL2CV::readWindow(GDALDataset* dataset, const int& xStart, const int& yStart, cv::Mat& img, const int& overview,
+	const cv::Size& source, const int& interpolation)
+{
+	GDALRasterBand* firstBand = getBand(dataset, 1, overview);
+	if (firstBand == nullptr){
+		return false;
+	}
+
+	GDALColorTable* gdalColorTable = NULL;
+	if (dataset->GetRasterBand(1)->GetColorInterpretation() == GCI_PaletteIndex){
+		gdalColorTable = dataset->GetRasterBand(1)->GetColorTable();
+		if (gdalColorTable == NULL){
+			return false;
+		}
+	}
+
+	// decode every block once for all the bands
+	const cv::Size window = source.area() > 0 ? source : img.size();
+	if (gdalColorTable == NULL && overview < 0 && readDatasetNative(dataset, cv::Rect(cv::Point(xStart, yStart), window), img, interpolation)){
+		return true;
+	}
+
+	// iterate over each raster band
+	// note that OpenCV does bgr rather than rgb
+	int nChannels = dataset->GetRasterCount();
+
+	// the image isn't cleared up front, only when some channel may not get a band
+	static thread_local std::vector<int> bandMap;
+	if (gdalColorTable == NULL && (!(nChannels == img.channels() || (nChannels == 4 && img.channels() == 3)) ||
+		!getBandMap(dataset, img.channels(), bandMap))){
+		img = cv::Scalar::all(0);
+	}
+
+	for (int c = 0; c < img.channels(); c++){
+
+		int realBandIndex = c;
+
+		// get the GDAL Band
+		GDALRasterBand* band = getBand(dataset, c + 1, overview);
+		if (band == nullptr){ return false; }
+
+		if (GCI_RedBand == band->GetColorInterpretation()) realBandIndex = 2;
+		if (GCI_GreenBand == band->GetColorInterpretation()) realBandIndex = 1;
+		if (GCI_BlueBand == band->GetColorInterpretation()) realBandIndex = 0;
+
+		if (gdalColorTable != NULL && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
+		// make sure the image band has the same dimensions as the dataset
+		if (band->GetXSize() != firstBand->GetXSize() || band->GetYSize() != firstBand->GetYSize()){ return false; }
+
+		if (!readBand(band, nChannels, gdalColorTable, xStart, yStart, img, gdalColorTable != NULL ? c : realBandIndex, source, interpolation)){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+* the coarsest overview that still has at least the resolution of dsize over the window,
+* -1 for the full resolution; every band must have the overview at the same size
+*/
+int KGDAL2CV::getBestOverview(GDALDataset* dataset, const cv::Rect& window, const cv::Size& dsize)
+{
+	GDALRasterBand* band = dataset->GetRasterBand(1);
+	const int width = dataset->GetRasterXSize();
+	const int height = dataset->GetRasterYSize();
+
+	int best = -1;
+	int bestWidth = width;
+	for (int i = 0; i < band->GetOverviewCount(); i++){
+		GDALRasterBand* overview = band->GetOverview(i);
+		if (overview == nullptr || overview->GetXSize() >= bestWidth) continue;
+
+		const double xScale = static_cast<double>(overview->GetXSize()) / width;
+		const double yScale = static_cast<double>(overview->GetYSize()) / height;
+		if (window.width * xScale < dsize.width || window.height * yScale < dsize.height) continue;
+
+		bool complete = true;
+		for (int b = 2; b <= dataset->GetRasterCount() && complete; b++){
+			GDALRasterBand* other = getBand(dataset, b, i);
+			complete = other != nullptr && other->GetXSize() == overview->GetXSize() && other->GetYSize() == overview->GetYSize();
+		}
+		if (complete){
+			best = i;
+			bestWidth = overview->GetXSize();
+		}
+	}
+	return best;
+}
+
+/**
+* read the window resampled to the size of img, only the best overview is read; GDAL resamples
+* when the bands can be read natively, otherwise the overview window is converted and resized
+*/
+bool KGDAL2CV::readWindowScaled(GDALDataset* dataset, const cv::Rect& window, cv::Mat& img, const int& interpolation)
+{
+	if (window.size() == img.size()){
+		return readWindow(dataset, window.x, window.y, img);
+	}
+
+	// the bands are read at their native type straight into a buffer of the output size, GDAL
+	// resamples from the best overview, then converted or expanded like a full resolution read
+	if (readWindow(dataset, window.x, window.y, img, -1, window.size(), interpolation)){
+		return true;
+	}
+
+	// channel layouts that are converted pixel by pixel, read the best overview and resize it
+	const int overview = getBestOverview(dataset, window, img.size());
+	cv::Rect area = window;
+	if (overview >= 0){
+		GDALRasterBand* band = getBand(dataset, 1, overview);
+		const double xScale = static_cast<double>(band->GetXSize()) / dataset->GetRasterXSize();
+		const double yScale = static_cast<double>(band->GetYSize()) / dataset->GetRasterYSize();
+
+		const int x0 = cvFloor(window.x * xScale);
+		const int y0 = cvFloor(window.y * yScale);
+		const int x1 = std::min(band->GetXSize(), static_cast<int>(std::ceil((window.x + window.width) * xScale)));
+		const int y1 = std::min(band->GetYSize(), static_cast<int>(std::ceil((window.y + window.height) * yScale)));
+		area = cv::Rect(x0, y0, std::max(1, x1 - x0), std::max(1, y1 - y0));
+	}
+
+	cv::Mat source(area.height, area.width, img.type());
+	if (!readWindow(dataset, area.x, area.y, source, overview)){
+		return false;
+	}
+	cv::resize(source, img, img.size(), 0, 0, interpolation);
+	return true;
+}
+
+/**
+* the smallest multiple of the block size that reaches minSize
+*/
+static int getTileSize(int blockSize, const int& minSize)
+{
+	blockSize = std::max(1, blockSize);
+	return (std::max(minSize, blockSize) + blockSize - 1) / blockSize * blockSize;
+}
+
+/**
+* split the area into tiles aligned to the block grid, small blocks are grouped
+* until a tile reaches minSize on each side
+*/
+static std::vector<cv::Rect> getBlockTiles(const cv::Rect& area, int blockXSize, int blockYSize, const int& minSize)
+{
+	const int tileXSize = getTileSize(blockXSize, minSize);
+	const int tileYSize = getTileSize(blockYSize, minSize);
+
+	std::vector<cv::Rect> tiles;
+	for (int y = area.y / tileYSize * tileYSize; y < area.y + area.height; y += tileYSize){
+		for (int x = area.x / tileXSize * tileXSize; x < area.x + area.width; x += tileXSize){
+			cv::Rect tile = cv::Rect(x, y, tileXSize, tileYSize) & area;
+			if (tile.area() > 0) tiles.push_back(tile);
+		}
+	}
+	return tiles;
+}
+
+// tiles of the parallel reader and of the tile cache are at least this large
+static const int MIN_TILE_SIZE = 256;
+
+/**
+* read the whole raster with a pool of threads, every thread leases its own GDALDataset
+* since the handles aren't thread-safe, and decodes block aligned tiles into the image
+*/
+bool KGDAL2CV::readDataParallel(cv::Mat& img, cv::Mat& mask, KGDALStats* stats)
+{
+	int blockXSize, blockYSize;
+	m_dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	const std::vector<cv::Rect> tiles = getBlockTiles(cv::Rect(0, 0, m_width, m_height), blockXSize, blockYSize, MIN_TILE_SIZE);
+
+	const int nThreads = std::min(getThreadCount(), static_cast<int>(tiles.size()));
+	if (nThreads <= 1){
+		return (mask.empty() && stats == nullptr) ? readWindow(m_dataset, 0, 0, img) : readWindowStrips(m_dataset, 0, 0, img, mask, stats);
+	}
+
+	std::atomic<int> nextTile(0);
+	std::atomic<bool> failed(false);
+	std::mutex statsMutex;
+	std::vector<std::thread> workers;
+
+	for (int t = 0; t < nThreads; t++){
+		workers.push_back(std::thread([&](){
+			GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+			if (dataset == nullptr){
+				failed = true;
+				return;
+			}
+
+			// every thread gathers its own statistics, they are merged at the end
+			KGDALStats local;
+			if (stats != nullptr) local = *stats;
+
+			for (int index = nextTile++; index < static_cast<int>(tiles.size()) && !failed; index = nextTile++){
+				cv::Mat tile = img(tiles[index]);
+				cv::Mat maskTile = mask.empty() ? cv::Mat() : mask(tiles[index]);
+				if (!((mask.empty() && stats == nullptr) ? readWindow(dataset, tiles[index].x, tiles[index].y, tile) :
+					readWindowStrips(dataset, tiles[index].x, tiles[index].y, tile, maskTile, stats == nullptr ? nullptr : &local))){
+					failed = true;
+				}
+			}
+			KGDALDatasetCache::Instance().Release(dataset);
+
+			if (stats != nullptr){
+				std::lock_guard<std::mutex> lock(statsMutex);
+				stats->Merge(local);
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++){
+		workers[t].join();
+	}
+
+	return !failed;
+}
+
+/**
+* read the window through the decoded tile cache, every tile of the grid touched by the window
+* is decoded once at the output type and later windows copy from it
+*/
+bool KGDAL2CV::readWindowCached(const cv::String& filename, GDALDataset* dataset, const int& xStart, const int& yStart, cv::Mat& img)
+{
+	KGDALTileCache& cache = KGDALTileCache::Instance();
+	if (cache.GetBudget() == 0 || filename.empty()){
+		return readWindow(dataset, xStart, yStart, img);
+	}
+
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	const int tileXSize = getTileSize(blockXSize, MIN_TILE_SIZE);
+	const int tileYSize = getTileSize(blockYSize, MIN_TILE_SIZE);
+	const cv::Rect raster(0, 0, dataset->GetRasterXSize(), dataset->GetRasterYSize());
+	const cv::Rect window(xStart, yStart, img.cols, img.rows);
+
+	const std::vector<cv::Rect> parts = getBlockTiles(window, blockXSize, blockYSize, MIN_TILE_SIZE);
+	for (size_t i = 0; i < parts.size(); i++){
+		const cv::Rect area = cv::Rect(parts[i].x / tileXSize * tileXSize, parts[i].y / tileYSize * tileYSize, tileXSize, tileYSize) & raster;
+
+		cv::Mat tile;
+		if (!cache.Get(filename, img.type(), area, tile)){
+			tile.create(area.height, area.width, img.type());
+			if (!readWindow(dataset, area.x, area.y, tile)){
+				return false;
+			}
+			cache.Put(filename, img.type(), area, tile);
+		}
+
+		cv::Mat part = img(parts[i] - window.tl());
+		tile(parts[i] - area.tl()).copyTo(part);
+	}
+	return true;
+}
+
+/**
+* mark the pixels of one channel that differ from the nodata value as valid
+*/
+template<typename T>
+static void maskNoDataRow(const uchar* src, const int& channels, const int& channel, const double& noData, uchar* mask, const int& width)
+{
+	const T* row = reinterpret_cast<const T*>(src) + channel;
+	const T value = static_cast<T>(noData);
+	for (int x = 0; x < width; x++, row += channels){
+		if (*row != value) mask[x] = 255;
+	}
+}
+
+// a NaN nodata matches the NaN pixels
+template<typename T>
+static void maskNaNRow(const uchar* src, const int& channels, const int& channel, uchar* mask, const int& width)
+{
+	const T* row = reinterpret_cast<const T*>(src) + channel;
+	for (int x = 0; x < width; x++, row += channels){
+		if (*row == *row) mask[x] = 255;
+	}
+}
+
+/**
+* true when the nodata value can be stored in the depth, otherwise no pixel can match it
+*/
+static bool isNoDataRepresentable(const double& noData, const int& depth)
+{
+	if (noData != noData){
+		return depth == CV_32F || depth == CV_64F;
+	}
+	switch (depth){
+	case CV_8U:  return noData == cv::saturate_cast<uchar>(noData);
+	case CV_16U: return noData == cv::saturate_cast<ushort>(noData);
+	case CV_16S: return noData == cv::saturate_cast<short>(noData);
+	case CV_32S: return noData == cv::saturate_cast<int>(noData);
+	case CV_32F: return noData == static_cast<float>(noData);
+	default:     return true;
+	}
+}
+
+/**
+* compute the validity mask (255 valid, 0 invalid) of a window that was just read into img,
+* a pixel is valid when any of its bands is; nodata values of bands read without a range cast
+* are compared on the rows of img, every other kind of mask comes from GDAL's mask band
+*/
+bool KGDAL2CV::readMask(GDALDataset* dataset, const int& xStart, const int& yStart, const cv::Mat& img, cv::Mat& mask)
+{
+	const bool palette = dataset->GetRasterBand(1)->GetColorInterpretation() == GCI_PaletteIndex;
+	const int nBand = palette ? 1 : std::min(dataset->GetRasterCount(), img.channels());
+
+	// channel of every band in img, when the channels follow the bands
+	static thread_local std::vector<int> bandMap;
+	const bool mapped = !palette && getBandMap(dataset, nBand, bandMap);
+
+	mask = cv::Scalar::all(0);
+	for (int b = 1; b <= nBand; b++){
+		GDALRasterBand* band = dataset->GetRasterBand(b);
+		const int flags = band->GetMaskFlags();
+
+		if (flags & GMF_ALL_VALID){
+			mask = cv::Scalar::all(255);
+			return true;
+		}
+
+		int channel = -1;
+		for (int c = 0; mapped && c < nBand; c++){
+			if (bandMap[c] == b) channel = c;
+		}
+
+		if ((flags & GMF_NODATA) && channel >= 0 && opencv2gdal(img.depth()) == band->GetRasterDataType()){
+			const double noData = band->GetNoDataValue();
+			if (!isNoDataRepresentable(noData, img.depth())){
+				mask = cv::Scalar::all(255);
+				return true;
+			}
+
+			for (int y = 0; y < img.rows; y++){
+				const uchar* row = img.ptr<uchar>(y);
+				uchar* maskRow = mask.ptr<uchar>(y);
+				switch (img.depth()){
+				case CV_8U:  maskNoDataRow<uchar>(row, img.channels(), channel, noData, maskRow, img.cols); break;
+				case CV_16U: maskNoDataRow<ushort>(row, img.channels(), channel, noData, maskRow, img.cols); break;
+				case CV_16S: maskNoDataRow<short>(row, img.channels(), channel, noData, maskRow, img.cols); break;
+				case CV_32S: maskNoDataRow<int>(row, img.channels(), channel, noData, maskRow, img.cols); break;
+				case CV_32F:
+					if (noData != noData) maskNaNRow<float>(row, img.channels(), channel, maskRow, img.cols);
+					else maskNoDataRow<float>(row, img.channels(), channel, noData, maskRow, img.cols);
+					break;
+				case CV_64F:
+					if (noData != noData) maskNaNRow<double>(row, img.channels(), channel, maskRow, img.cols);
+					else maskNoDataRow<double>(row, img.channels(), channel, noData, maskRow, img.cols);
+					break;
+				default: return false;
+				}
+			}
+			continue;
+		}
+
+		// alpha, per dataset or external masks, and nodata of range cast bands
+		uchar* values = getScratch(SCRATCH_MASK, static_cast<size_t>(img.cols) * img.rows);
+		if (band->GetMaskBand()->RasterIO(GF_Read, xStart, yStart, img.cols, img.rows, values, img.cols, img.rows, GDT_Byte, 0, 0) != CE_None){
+			return false;
+		}
+		for (int y = 0; y < img.rows; y++){
+			const uchar* valueRow = values + static_cast<size_t>(y) * img.cols;
+			uchar* maskRow = mask.ptr<uchar>(y);
+			for (int x = 0; x < img.cols; x++){
+				if (valueRow[x] != 0) maskRow[x] = 255;
+			}
+		}
+
+		// one mask for all the bands
+		if (flags & GMF_PER_DATASET) break;
+	}
+	return true;
+}
+
+// strips of the masked reader are kept about this small, so their rows are still cached for the mask
+static const size_t MASK_STRIP_BYTES = 1 << 20;
+
+// bins of the histograms of 32 bit and floating point data
+static const int HIST_BINS = 1024;
+
+/**
+* add the pixels of the image that the mask (if any) marks as valid to the statistics
+*/
+template<typename T>
+static void accumulateStats(const cv::Mat& img, const cv::Mat& mask, KGDALStats& stats)
+{
+	const int channels = img.channels();
+	for (int c = 0; c < channels; c++){
+		KGDALBandStats& band = stats.bands[c];
+		double minValue = band.min, maxValue = band.max, sum = 0, sumSq = 0;
+		size_t count = 0;
+
+		const int bins = static_cast<int>(band.histogram.size());
+		const double scale = bins > 0 ? bins / (band.histMax - band.histMin) : 0;
+		size_t* histogram = bins > 0 ? &band.histogram[0] : nullptr;
+
+		for (int y = 0; y < img.rows; y++){
+			const T* row = img.ptr<T>(y) + c;
+			const uchar* valid = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+
+			for (int x = 0; x < img.cols; x++, row += channels){
+				const double value = static_cast<double>(*row);
+				if ((valid != nullptr && valid[x] == 0) || value != value) continue;
+
+				minValue = std::min(minValue, value);
+				maxValue = std::max(maxValue, value);
+				sum += value;
+				sumSq += value * value;
+				count++;
+
+				if (histogram != nullptr){
+					const int bin = static_cast<int>((value - band.histMin) * scale);
+					histogram[std::min(std::max(bin, 0), bins - 1)]++;
+				}
+			}
+		}
+
+		band.min = minValue;
+		band.max = maxValue;
+		band.sum += sum;
+		band.sumSq += sumSq;
+		band.count += count;
+	}
+}
+
+static void accumulateStats(const cv::Mat& img, const cv::Mat& mask, KGDALStats& stats)
+{
+	switch (img.depth()){
+	case CV_8U:  accumulateStats<uchar>(img, mask, stats); break;
+	case CV_8S:  accumulateStats<schar>(img, mask, stats); break;
+	case CV_16U: accumulateStats<ushort>(img, mask, stats); break;
+	case CV_16S: accumulateStats<short>(img, mask, stats); break;
+	case CV_32S: accumulateStats<int>(img, mask, stats); break;
+	case CV_32F: accumulateStats<float>(img, mask, stats); break;
+	case CV_64F: accumulateStats<double>(img, mask, stats); break;
+	default: break;
+	}
+}
+
+/**
+* bin the valid values of img into the histograms that are still empty, over [min, max] of
+* the statistics accumulated while reading, so no value falls outside the bins
+*/
+template<typename T>
+static void binHistogram(const cv::Mat& img, const cv::Mat& mask, KGDALStats& stats, const int& bins)
+{
+	const int channels = img.channels();
+	for (int c = 0; c < channels; c++){
+		KGDALBandStats& band = stats.bands[c];
+		if (static_cast<int>(band.histogram.size()) != bins) continue;
+
+		const double scale = bins / (band.histMax - band.histMin);
+		size_t* histogram = &band.histogram[0];
+
+		for (int y = 0; y < img.rows; y++){
+			const T* row = img.ptr<T>(y) + c;
+			const uchar* valid = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+
+			for (int x = 0; x < img.cols; x++, row += channels){
+				const double value = static_cast<double>(*row);
+				if ((valid != nullptr && valid[x] == 0) || value != value) continue;
+
+				const int bin = static_cast<int>((value - band.histMin) * scale);
+				histogram[std::min(std::max(bin, 0), bins - 1)]++;
+			}
+		}
+	}
+}
+
+static void binHistogram(const cv::Mat& img, const cv::Mat& mask, KGDALStats& stats, const int& bins)
+{
+	switch (img.depth()){
+	case CV_32S: binHistogram<int>(img, mask, stats, bins); break;
+	case CV_32F: binHistogram<float>(img, mask, stats, bins); break;
+	case CV_64F: binHistogram<double>(img, mask, stats, bins); break;
+	default: break;
+	}
+}
+
+/**
+* read a window strip by strip, the validity mask and the statistics (either is optional) of
+* every strip are computed right after its pixels were converted, while they are still cached;
+* the statistics skip nodata and masked pixels
+*/
+bool KGDAL2CV::readWindowStrips(GDALDataset* dataset, const int& xStart, const int& yStart, cv::Mat& img, cv::Mat& mask, KGDALStats* stats)
+{
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	blockYSize = std::max(1, blockYSize);
+
+	// whole block rows, so no block is decoded twice
+	const size_t blockRowBytes = static_cast<size_t>(blockYSize) * img.cols * img.elemSize();
+	const int stripRows = blockYSize * std::max<int>(1, static_cast<int>(MASK_STRIP_BYTES / std::max<size_t>(1, blockRowBytes)));
+
+	// the statistics need a mask of their own unless every pixel is valid
+	bool needMask = !mask.empty();
+	for (int b = 1; b <= dataset->GetRasterCount() && !needMask && stats != nullptr; b++){
+		needMask = !(dataset->GetRasterBand(b)->GetMaskFlags() & GMF_ALL_VALID);
+	}
+
+	for (int y = 0; y < img.rows;){
+		const int nRows = std::min(img.rows - y, stripRows - (yStart + y) % stripRows);
+
+		cv::Mat imgStrip = img.rowRange(y, y + nRows);
+		cv::Mat maskStrip;
+		if (!mask.empty()){
+			maskStrip = mask.rowRange(y, y + nRows);
+		}
+		else if (needMask){
+			maskStrip = cv::Mat(nRows, img.cols, CV_8UC1, getScratch(SCRATCH_VALID, static_cast<size_t>(nRows) * img.cols));
+		}
+
+		if (!readWindow(dataset, xStart, yStart + y, imgStrip) ||
+			(needMask && !readMask(dataset, xStart, yStart + y, imgStrip, maskStrip))){
+			return false;
+		}
+		if (stats != nullptr){
+			accumulateStats(imgStrip, maskStrip, *stats);
+		}
+		y += nRows;
+	}
+	return true;
+}
+
+/**
+* second pass over a decoded window for the histograms initStats couldn't size, they get
+* HIST_BINS bins over the exact range of the channel; masked pixels are skipped like in the read
+*/
+bool KGDAL2CV::binStats(GDALDataset* dataset, const int& xStart, const int& yStart, const cv::Mat& img, KGDALStats& stats)
+{
+	for (size_t c = 0; c < stats.bands.size(); c++){
+		KGDALBandStats& band = stats.bands[c];
+		if (!band.histogram.empty() || band.count == 0) continue;
+
+		band.histMin = band.min;
+		band.histMax = band.max > band.min ? band.max : band.min + 1;
+		band.histogram.assign(HIST_BINS, 0);
+	}
+
+	bool needMask = false;
+	for (int b = 1; b <= dataset->GetRasterCount() && !needMask; b++){
+		needMask = !(dataset->GetRasterBand(b)->GetMaskFlags() & GMF_ALL_VALID);
+	}
+
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	const size_t blockRowBytes = static_cast<size_t>(std::max(1, blockYSize)) * img.cols * img.elemSize();
+	const int stripRows = std::max(1, blockYSize) * std::max<int>(1, static_cast<int>(MASK_STRIP_BYTES / std::max<size_t>(1, blockRowBytes)));
+
+	for (int y = 0; y < img.rows; y += stripRows){
+		const int nRows = std::min(img.rows - y, stripRows);
+
+		const cv::Mat imgStrip = img.rowRange(y, y + nRows);
+		cv::Mat maskStrip;
+		if (needMask){
+			maskStrip = cv::Mat(nRows, img.cols, CV_8UC1, getScratch(SCRATCH_VALID, static_cast<size_t>(nRows) * img.cols));
+			if (!readMask(dataset, xStart, yStart + y, imgStrip, maskStrip)){
+				return false;
+			}
+		}
+		binHistogram(imgStrip, maskStrip, stats, HIST_BINS);
+	}
+	return true;
+}
+
+// the longer side of the overview sample a stretch is estimated from
+static const int STRETCH_SAMPLE_SIZE = 512;
+
+/**
+* the value of a channel from per channel values, a single value applies to all the channels
+*/
+static double channelValue(const std::vector<double>& values, const int& channel, const double& value)
+{
+	return values.empty() ? value : values[std::min<size_t>(channel, values.size() - 1)];
+}
+
+/**
+* the value below which percent of the values lie
+*/
+static double getPercentile(std::vector<double>& values, const double& percent)
+{
+	const double rank = std::max(0.0, std::min(100.0, percent)) / 100.0 * (values.size() - 1);
+	std::vector<double>::iterator nth = values.begin() + static_cast<size_t>(rank + 0.5);
+	std::nth_element(values.begin(), nth, values.end());
+	return *nth;
+}
+
+/**
+* low, high and gamma of every channel; what the caller left out is estimated from a sample
+* of the window read from the best overview, without nodata and NaN
+*/
+bool KGDAL2CV::getStretch(GDALDataset* dataset, const cv::Rect& window, const int& channels, const KGDALStretch& stretch,
+	std::vector<double>& low, std::vector<double>& high, std::vector<double>& gamma)
+{
+	low.resize(channels);
+	high.resize(channels);
+	gamma.resize(channels);
+	for (int c = 0; c < channels; c++){
+		low[c] = channelValue(stretch.low, c, 0);
+		high[c] = channelValue(stretch.high, c, 0);
+		gamma[c] = channelValue(stretch.gamma, c, 1);
+	}
+	if (!stretch.low.empty() && !stretch.high.empty()){
+		return true;
+	}
+
+	std::vector<int> bandMap;
+	if (!getBandMap(dataset, channels, bandMap)){
+		for (int c = 0; c < channels; c++) bandMap[c] = c + 1;
+	}
+
+	// GDAL decimates while reading, from an overview if there is one, and nearest neighbour
+	// keeps the sample at the values of the raster
+	const double scale = std::min(1.0, static_cast<double>(STRETCH_SAMPLE_SIZE) / std::max(window.width, window.height));
+	cv::Mat sample(std::max(1, cvRound(window.height * scale)), std::max(1, cvRound(window.width * scale)), CV_MAKETYPE(CV_64F, channels));
+
+	GDALRasterIOExtraArg extraArg;
+	INIT_RASTERIO_EXTRA_ARG(extraArg);
+	extraArg.eResampleAlg = GRIORA_NearestNeighbour;
+
+	if (CE_None != dataset->RasterIO(GF_Read, window.x, window.y, window.width, window.height, sample.ptr<uchar>(0), sample.cols, sample.rows, GDT_Float64,
+		channels, &bandMap[0], static_cast<GSpacing>(sample.elemSize()), static_cast<GSpacing>(sample.step[0]),
+		static_cast<GSpacing>(sample.elemSize1()), &extraArg)){
+		return false;
+	}
+
+	std::vector<double> values;
+	values.reserve(sample.total());
+	for (int c = 0; c < channels; c++){
+		GDALRasterBand* band = dataset->GetRasterBand(bandMap[c]);
+		int hasNoData = FALSE;
+		const double noData = band == nullptr ? 0 : band->GetNoDataValue(&hasNoData);
+
+		values.clear();
+		for (int y = 0; y < sample.rows; y++){
+			const double* row = sample.ptr<double>(y) + c;
+			for (int x = 0; x < sample.cols; x++, row += channels){
+				if (*row == *row && !(hasNoData && *row == noData)) values.push_back(*row);
+			}
+		}
+		if (values.empty()) continue;
+
+		if (stretch.low.empty()) low[c] = getPercentile(values, stretch.clipLow);
+		if (stretch.high.empty()) high[c] = getPercentile(values, 100 - stretch.clipHigh);
+	}
+	return true;
+}
+
+/**
+* read a window stretched into an 8 bit or float image, every channel from its band
+*/
+bool KGDAL2CV::readWindowStretch(GDALDataset* dataset, const int& xStart, const int& yStart, cv::Mat& img,
+	const std::vector<double>& low, const std::vector<double>& high, const std::vector<double>& gamma)
+{
+	if (dataset->GetRasterBand(1)->GetColorInterpretation() == GCI_PaletteIndex){
+		std::cout << "The indices of a color table can't be stretched!" << std::endl;
+		return false;
+	}
+
+	static thread_local std::vector<int> bandMap;
+	if (!getBandMap(dataset, img.channels(), bandMap)){
+		for (int c = 0; c < img.channels(); c++) bandMap[c] = c + 1;
+	}
+
+	for (int c = 0; c < img.channels(); c++){
+		GDALRasterBand* band = dataset->GetRasterBand(bandMap[c]);
+		if (band == nullptr || !readBandStretch(band, xStart, yStart, img, c, low[c], high[c], gamma[c])){
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+* empty statistics for the image type, histograms of 8 and 16 bit data have a bin per value,
+* wider types get HIST_BINS bins over the exact range GDAL already has for the band, after the
+* range cast; nothing is computed or written here, so returns true when some histograms are
+* left empty for binStats to size from the range found while reading
+*/
+bool KGDAL2CV::initStats(GDALDataset* dataset, const int& type, const bool& histogram, KGDALStats& stats)
+{
+	stats.bands.assign(CV_MAT_CN(type), KGDALBandStats());
+	if (!histogram) return false;
+
+	const int depth = CV_MAT_DEPTH(type);
+
+	std::vector<int> bandMap;
+	const bool mapped = getBandMap(dataset, CV_MAT_CN(type), bandMap);
+
+	bool pending = false;
+	for (size_t c = 0; c < stats.bands.size(); c++){
+		KGDALBandStats& band = stats.bands[c];
+		int bins = 0;
+
+		switch (depth){
+		case CV_8U:  band.histMin = 0; band.histMax = 256; bins = 256; break;
+		case CV_8S:  band.histMin = -128; band.histMax = 128; bins = 256; break;
+		case CV_16U: band.histMin = 0; band.histMax = 65536; bins = 65536; break;
+		case CV_16S: band.histMin = -32768; band.histMax = 32768; bins = 65536; break;
+		default:{
+			// only exact statistics GDAL already has, forcing them would scan the band once more
+			// and mark the PAM dirty, approximate ones would clamp values into the edge bins
+			GDALRasterBand* gdalBand = dataset->GetRasterBand(mapped ? bandMap[c] : 1);
+			double minValue = 0, maxValue = 0;
+			if (gdalBand->GetStatistics(FALSE, FALSE, &minValue, &maxValue, nullptr, nullptr) == CE_None && maxValue > minValue){
+				// the bounds are cast like the rows: only byte data is scaled into 32 bit depths,
+				// every other pair keeps its values
+				const GDALDataType gdalType = gdalBand->GetRasterDataType();
+				const bool scaled = gdalType == GDT_Byte && (depth == CV_32F || depth == CV_32S);
+				band.histMin = scaled ? range_cast(gdalType, depth, minValue) : minValue;
+				band.histMax = scaled ? range_cast(gdalType, depth, maxValue) : maxValue;
+				bins = band.histMax > band.histMin ? HIST_BINS : 0;
+			}
+			pending = pending || bins == 0;
+			break;
+		}
+		}
+		band.histogram.assign(bins, 0);
+	}
+	return pending;
+}
+
+/**
+* statistics of the whole raster that GDAL already knows, only exact ones, only when the bands
+* are read without a range cast and only when the number of valid pixels is known
+*/
+bool KGDAL2CV::getCachedStats(GDALDataset* dataset, const int& type, KGDALStats& stats)
+{
+	std::vector<int> bandMap;
+	if (dataset->GetRasterBand(1)->GetColorInterpretation() == GCI_PaletteIndex || !getBandMap(dataset, CV_MAT_CN(type), bandMap)){
+		return false;
+	}
+
+	KGDALStats cached;
+	cached.bands.resize(bandMap.size());
+	for (size_t c = 0; c < bandMap.size(); c++){
+		GDALRasterBand* band = dataset->GetRasterBand(bandMap[c]);
+		double minValue, maxValue, mean, stdDev;
+		if (!isNativeCast(band->GetRasterDataType(), CV_MAT_DEPTH(type)) ||
+			band->GetStatistics(FALSE, FALSE, &minValue, &maxValue, &mean, &stdDev) != CE_None){
+			return false;
+		}
+
+		// the count of valid pixels comes from GDAL too, without it only bands without any invalid
+		// pixel can use the cached values
+		const size_t total = static_cast<size_t>(dataset->GetRasterXSize()) * dataset->GetRasterYSize();
+		size_t count = total;
+		const char* validPercent = band->GetMetadataItem("STATISTICS_VALID_PERCENT");
+		if (validPercent != nullptr){
+			count = static_cast<size_t>(CPLAtof(validPercent) / 100.0 * total + 0.5);
+		}
+		else if (!(band->GetMaskFlags() & GMF_ALL_VALID)){
+			return false;
+		}
+
+		KGDALBandStats& result = cached.bands[c];
+		result.min = minValue;
+		result.max = maxValue;
+		result.count = count;
+		result.sum = mean * result.count;
+		result.sumSq = (stdDev * stdDev + mean * mean) * result.count;
+	}
+
+	stats = cached;
+	return true;
+}
+
+/**
+* write the image with its validity mask; with a nodata value the masked pixels of every chunk
+* are filled by SetNumThreads threads while a lock serializes the calls into GDAL, the chunks
+* follow the block grid so the driver gets complete blocks; otherwise the image and the mask
+* band are written with a single call each
+*/
+bool KGDAL2CV::writeMasked(GDALDataset* dataset, const int& xStart, const int& yStart, const cv::Mat& img, std::vector<int>& bandMap, const cv::Mat& mask)
+{
+	if (mask.empty()){
+		return writeDatasetNative(dataset, xStart, yStart, img, bandMap);
+	}
+
+	// masked pixels get the nodata value of their band, without one the mask goes into the mask band
+	std::vector<double> noData(bandMap.size());
+	std::vector<int> bandHasNoData(bandMap.size(), 0);
+	bool hasNoData = false;
+	for (size_t c = 0; c < bandMap.size(); c++){
+		noData[c] = dataset->GetRasterBand(bandMap[c])->GetNoDataValue(&bandHasNoData[c]);
+		hasNoData = hasNoData || bandHasNoData[c];
+	}
+	if (!hasNoData){
+		if (!(dataset->GetRasterBand(1)->GetMaskFlags() & GMF_PER_DATASET) && dataset->CreateMaskBand(GMF_PER_DATASET) != CE_None){
+			std::cout << "Failed to create the mask band!" << std::endl;
+			return false;
+		}
+		GDALRasterBand* maskBand = dataset->GetRasterBand(1)->GetMaskBand();
+		return writeDatasetNative(dataset, xStart, yStart, img, bandMap) && writeBandNative(maskBand, xStart, yStart, mask, 0);
+	}
+
+	int blockXSize, blockYSize;
+	dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+	const std::vector<cv::Rect> tiles = getBlockTiles(cv::Rect(xStart, yStart, img.cols, img.rows), blockXSize, blockYSize, MIN_TILE_SIZE);
+	const int nThreads = std::min(getThreadCount(), static_cast<int>(tiles.size()));
+
+	std::atomic<int> nextTile(0);
+	std::atomic<bool> failed(false);
+	std::mutex gdalMutex;
+
+	auto work = [&](){
+		for (int index = nextTile++; index < static_cast<int>(tiles.size()) && !failed; index = nextTile++){
+			const cv::Rect area = tiles[index] - cv::Point(xStart, yStart);
+
+			// fill the masked pixels of a copy of the chunk channel by channel, outside of the lock
+			cv::Mat invalid;
+			cv::compare(mask(area), 0, invalid, cv::CMP_EQ);
+			std::vector<cv::Mat> channels;
+			cv::split(img(area), channels);
+			for (size_t c = 0; c < bandMap.size(); c++){
+				if (bandHasNoData[c]) channels[c].setTo(cv::Scalar(noData[c]), invalid);
+			}
+			cv::Mat chunk;
+			cv::merge(channels, chunk);
+
+			std::lock_guard<std::mutex> lock(gdalMutex);
+			if (!writeDatasetNative(dataset, tiles[index].x, tiles[index].y, chunk, bandMap)){
+				failed = true;
+			}
+		}
+	};
+
+	if (nThreads <= 1){
+		work();
+		return !failed;
+	}
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < nThreads; t++){
+		workers.push_back(std::thread(work));
+	}
+	for (size_t t = 0; t < workers.size(); t++){
+		workers[t].join();
+	}
+
+	return !failed;
+}
+
+/**
+* overview of the band closest to the given size, drivers round the sizes differently
+*/
+static GDALRasterBand* getOverviewBySize(GDALRasterBand* band, const int& width, const int& height)
+{
+	GDALRasterBand* best = nullptr;
+	int bestDistance = INT_MAX;
+	for (int i = 0; i < band->GetOverviewCount(); i++){
+		GDALRasterBand* overview = band->GetOverview(i);
+		if (overview == nullptr) continue;
+
+		const int distance = std::abs(overview->GetXSize() - width) + std::abs(overview->GetYSize() - height);
+		if (distance < bestDistance){
+			best = overview;
+			bestDistance = distance;
+		}
+	}
+	return best;
+}
+
+/**
+* weights of the source pixels under every target pixel of an area average, target pixel i covers
+* [(start + i) * scale, (start + i + 1) * scale) of the source; indices are relative to origin
+*/
+static void getAreaWeights(const int& start, const int& count, const double& scale, const int& origin, const int& length,
+	std::vector<int>& index, std::vector<double>& weight, std::vector<size_t>& offset)
+{
+	index.clear();
+	weight.clear();
+	offset.assign(1, 0);
+	for (int i = 0; i < count; i++){
+		const double from = (start + i) * scale;
+		const double to = std::min((start + i + 1) * scale, static_cast<double>(origin + length));
+		for (int k = std::max(origin, cvFloor(from)); k < to; k++){
+			const double w = std::min(k + 1.0, to) - std::max(static_cast<double>(k), from);
+			if (w <= 0) continue;
+			index.push_back(k - origin);
+			weight.push_back(w / (to - from));
+		}
+		offset.push_back(index.size());
+	}
+}
+
+/**
+* area average of a CV_64FC1 source window starting at origin into the target tile, every target
+* pixel averages exactly the source area it covers, so tiles of the same level never disagree
+*/
+static void resizeArea(const cv::Mat& src, const cv::Point& origin, const cv::Rect& tile, const double& xScale, const double& yScale, cv::Mat& dst)
+{
+	std::vector<int> xIndex, yIndex;
+	std::vector<double> xWeight, yWeight;
+	std::vector<size_t> xOffset, yOffset;
+	getAreaWeights(tile.x, tile.width, xScale, origin.x, src.cols, xIndex, xWeight, xOffset);
+	getAreaWeights(tile.y, tile.height, yScale, origin.y, src.rows, yIndex, yWeight, yOffset);
+
+	// columns first, then rows
+	cv::Mat columns(src.rows, tile.width, CV_64FC1);
+	for (int y = 0; y < src.rows; y++){
+		const double* srcRow = src.ptr<double>(y);
+		double* row = columns.ptr<double>(y);
+		for (int x = 0; x < tile.width; x++){
+			double sum = 0;
+			for (size_t k = xOffset[x]; k < xOffset[x + 1]; k++) sum += srcRow[xIndex[k]] * xWeight[k];
+			row[x] = sum;
+		}
+	}
+
+	dst.create(tile.height, tile.width, CV_64FC1);
+	for (int y = 0; y < tile.height; y++){
+		double* row = dst.ptr<double>(y);
+		std::fill(row, row + tile.width, 0.0);
+		for (size_t k = yOffset[y]; k < yOffset[y + 1]; k++){
+			const double* columnRow = columns.ptr<double>(yIndex[k]);
+			for (int x = 0; x < tile.width; x++) row[x] += columnRow[x] * yWeight[k];
+		}
+	}
+}
+
+/**
+* downsample the source band into the target overview tile by tile, the tiles follow the
+* block grid of the overview and are resized on the pool while a lock serializes GDAL; every
+* tile is mapped onto the source with the exact ratio of the sizes and reads the source pixels
+* its kernel reaches, so the tiles join without seams
+*/
+bool KGDAL2CV::buildOverviewLevel(GDALRasterBand* source, GDALRasterBand* target, const int& depth, const int& interpolation)
+{
+	int blockXSize, blockYSize;
+	target->GetBlockSize(&blockXSize, &blockYSize);
+	const std::vector<cv::Rect> tiles = getBlockTiles(cv::Rect(0, 0, target->GetXSize(), target->GetYSize()), blockXSize, blockYSize, MIN_TILE_SIZE);
+
+	const cv::Rect sourceArea(0, 0, source->GetXSize(), source->GetYSize());
+	const double xScale = static_cast<double>(source->GetXSize()) / target->GetXSize();
+	const double yScale = static_cast<double>(source->GetYSize()) / target->GetYSize();
+
+	// source pixels the kernel reaches beyond the footprint of a target pixel
+	const bool area = interpolation == cv::INTER_AREA;
+	const int pad = area ? 0 : (interpolation == cv::INTER_LANCZOS4 ? 4 : (interpolation == cv::INTER_CUBIC ? 2 : 1));
+
+	std::atomic<int> nextTile(0);
+	std::atomic<bool> failed(false);
+	std::mutex gdalMutex;
+
+	auto work = [&](){
+		for (int index = nextTile++; index < static_cast<int>(tiles.size()) && !failed; index = nextTile++){
+			const cv::Rect& tile = tiles[index];
+			const cv::Point tl(cvFloor(tile.x * xScale) - pad, cvFloor(tile.y * yScale) - pad);
+			const cv::Point br(cvCeil((tile.x + tile.width) * xScale) + pad, cvCeil((tile.y + tile.height) * yScale) + pad);
+			const cv::Rect window = cv::Rect(tl, br) & sourceArea;
+
+			cv::Mat src(window.height, window.width, area ? CV_64F : depth), dst;
+			{
+				std::lock_guard<std::mutex> lock(gdalMutex);
+				if (!readBandNative(source, window.x, window.y, src, 0)){
+					failed = true;
+					return;
+				}
+			}
+
+			if (area){
+				resizeArea(src, window.tl(), tile, xScale, yScale, dst);
+			}
+			else{
+				// the centers of the tile pixels in the window, like cv::resize maps them on the whole band
+				double m[6] = {
+					xScale, 0, (tile.x + 0.5) * xScale - 0.5 - window.x,
+					0, yScale, (tile.y + 0.5) * yScale - 0.5 - window.y };
+				cv::warpAffine(src, dst, cv::Mat(2, 3, CV_64F, m), tile.size(), interpolation | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+			}
+
+			std::lock_guard<std::mutex> lock(gdalMutex);
+			if (!writeBandNative(target, tile.x, tile.y, dst, 0)){
+				failed = true;
+			}
+		}
+	};
+
+	const int nThreads = std::min(getThreadCount(), static_cast<int>(tiles.size()));
+	if (nThreads <= 1){
+		work();
+		return !failed;
+	}
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < nThreads; t++){
+		workers.push_back(std::thread(work));
+	}
+	for (size_t t = 0; t < workers.size(); t++){
+		workers[t].join();
+	}
+
+	return !failed;
+}
+
+/**
+* read data
+*/
+bool KGDAL2CV::readData(cv::Mat img, cv::Mat mask, KGDALStats* stats){
+	// make sure the image is the proper size
+	if (img.size().height != m_height){
+		return false;
+	}
+	if (img.size().width != m_width){
+		return false;
+	}
+
+	// make sure the raster is alive
+	if (m_dataset == NULL || m_driver == NULL){
+		return false;
+	}
+
+	if (getThreadCount() > 1){
+		return readDataParallel(img, mask, stats);
+	}
+	return (mask.empty() && stats == nullptr) ? readWindow(m_dataset, 0, 0, img) : readWindowStrips(m_dataset, 0, 0, img, mask, stats);
+}
+
+/**
+* read the whole band, the header of the dataset read by readHeader is left alone
+*/
+cv::Mat KGDAL2CV::ImgReadByGDAL(GDALRasterBand* pBand, int depth)
+{
+	return ImgReadByGDAL(pBand, 0, 0, pBand->GetXSize(), pBand->GetYSize(), depth);
+}
+
+cv::Mat KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, bool beReadFourth, int depth)
+{
+	cv::Mat img;
+	if (!ImgReadByGDAL(filename, xStart, yStart, xWidth, yWidth, img, beReadFourth, depth)) img.release();
+	return img;
+}
+
+// OpenCV 4 passes the access flags of the allocator as cv::AccessFlag
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag MatAccessFlag;
+#else
+typedef int MatAccessFlag;
+#endif
+
+#ifndef CV_OVERRIDE
+#define CV_OVERRIDE override
+#endif
+
+/**
+* owner of a file mapping behind a cv::Mat, the mapping has to be freed before its dataset is closed
+*/
+struct MappedRaster
+{
+	CPLVirtualMem* mem;
+	GDALDataset* dataset;
+};
+
+/**
+* allocator of the mapped cv::Mat, it never allocates and releases the mapping with the last reference
+*/
+class MappedRasterAllocator : public cv::MatAllocator
+{
+public:
+	cv::UMatData* allocate(int, const int*, int, void*, size_t*, MatAccessFlag, cv::UMatUsageFlags) const CV_OVERRIDE { return nullptr; }
+	bool allocate(cv::UMatData*, MatAccessFlag, cv::UMatUsageFlags) const CV_OVERRIDE { return false; }
+	void deallocate(cv::UMatData* u) const CV_OVERRIDE
+	{
+		if (u == nullptr) return;
+
+		MappedRaster* raster = static_cast<MappedRaster*>(u->handle);
+		CPLVirtualMemFree(raster->mem);
+		KGDALDatasetCache::Instance().Release(raster->dataset);
+		delete raster;
+		delete u;
+	}
+};
+
+/**
+* the allocator of every mapped cv::Mat, reads recognize a mapped cv::Mat by it
+*/
+static MappedRasterAllocator& getMappedAllocator()
+{
+	static MappedRasterAllocator allocator;
+	return allocator;
+}
+
+/**
+* a mapped cv::Mat is read-only memory, it must not be kept as the storage of a read
+*/
+static void releaseMapped(cv::OutputArray dst)
+{
+	if (!dst.isMat()) return;
+
+	cv::Mat& img = dst.getMatRef();
+	if (img.u != nullptr && img.u->currAllocator == &getMappedAllocator()) img.release();
+}
+
+/**
+* read a window into dst, its storage is reused when the size and type already match, so
+* reading tile after tile into the same cv::Mat doesn't allocate
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	if (!checkWindow(xStart, yStart, xWidth, yWidth)) return false;
+
+	releaseMapped(dst);
+	dst.create(yWidth, xWidth, outputType(beReadFourth, depth));
+	cv::Mat img = dst.getMat();
+	return readWindowCached(m_filename, m_dataset, xStart, yStart, img);
+}
+
+/**
+* read the whole raster resampled to dsize, or scaled by fx and fy when dsize is empty
+*/
+cv::Mat KGDAL2CV::ImgReadByGDAL(const cv::String& filename, cv::Size dsize, double fx, double fy, int interpolation, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return cv::Mat();
+
+	m_filename = filename;
+	if (!readHeader()) return cv::Mat();
+
+	return ImgReadByGDAL(filename, 0, 0, m_width, m_height, dsize, fx, fy, interpolation, beReadFourth, depth);
+}
+
+/**
+* read a window resampled to dsize, or scaled by fx and fy when dsize is empty, in the same
+* way as cv::resize; the data comes from the best overview so a small preview reads little
+*/
+cv::Mat KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, cv::Size dsize, double fx, double fy, int interpolation, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return cv::Mat();
+
+	m_filename = filename;
+	if (!readHeader()) return cv::Mat();
+
+	if (!checkWindow(xStart, yStart, xWidth, yWidth)) return cv::Mat();
+
+	if (dsize.width <= 0 || dsize.height <= 0){
+		if (fx <= 0 || fy <= 0){
+			std::cout << "wrong param!" << std::endl;
+			return cv::Mat();
+		}
+		dsize = cv::Size(std::max(1, cvRound(xWidth * fx)), std::max(1, cvRound(yWidth * fy)));
+	}
+
+	int tempType = outputType(beReadFourth, depth);
+	cv::Mat img(dsize.height, dsize.width, tempType);
+	if (!readWindowScaled(m_dataset, cv::Rect(xStart, yStart, xWidth, yWidth), img, interpolation)){
+		return cv::Mat();
+	}
+	return img;
+}
+
+/**
+* read a window of the band, only locals are used so the header of the dataset read by readHeader
+* is left alone
+*/
+cv::Mat KGDAL2CV::ImgReadByGDAL(GDALRasterBand* pBand, int xStart, int yStart, int xWidth, int yWidth, int depth)
+{
+	if (!checkDepth(depth)) return cv::Mat();
+
+	const int width = pBand->GetXSize();
+	const int height = pBand->GetYSize();
+
+	// check if we have a color palette
+	GDALColorTable* gdalColorTable = NULL;
+	int type;
+	if (pBand->GetColorInterpretation() == GCI_PaletteIndex){
+
+		// if the color tables does not exist, then we failed
+		gdalColorTable = pBand->GetColorTable();
+		if (gdalColorTable == NULL){
+			return cv::Mat();
+		}
+
+		// convert the palette interpretation to opencv type
+		type = gdalPaletteInterpretation2OpenCV(gdalColorTable->GetPaletteInterpretation(), pBand->GetRasterDataType());
+	}
+	// otherwise, we have standard channels
+	else{
+		type = gdal2opencv(pBand->GetRasterDataType(), 1);
+	}
+	if (type == -1){
+		return cv::Mat();
+	}
+
+	if (xStart < 0 || yStart < 0 || xWidth < 1 || yWidth < 1 || xStart > width - 1 || yStart > height - 1) return cv::Mat();
+
+	if (xStart + xWidth > width)
+	{
+		std::cout << "The specified width is invalid, Automatic optimization is executed!" << std::endl;
+		xWidth = width - xStart;
+	}
+
+	if (yStart + yWidth > height)
+	{
+		std::cout << "The specified height is invalid, Automatic optimization is executed!" << std::endl;
+		yWidth = height - yStart;
+	}
+
+	if (depth >= 0) type = CV_MAKETYPE(depth, CV_MAT_CN(type));
+	cv::Mat img(yWidth, xWidth, type);
+
+	for (int c = 0; c < img.channels(); c++){
+		if (gdalColorTable != NULL && gdalColorTable->GetPaletteInterpretation() == GPI_RGB) c = img.channels() - 1;
+
+		if (!readBand(pBand, 1, gdalColorTable, xStart, yStart, img, c)){
+			return cv::Mat();
+		}
+	}
+
+	return img;
+}
+
+cv::Mat KGDAL2CV::ImgReadByGDAL(const cv::String& filename, bool beReadFourth, int depth)
+{
+	cv::Mat img;
+	if (!ImgReadByGDAL(filename, img, beReadFourth, depth)) img.release();
+	return img;
+}
+
+/**
+* read the whole raster into dst, its storage is reused when the size and type already match
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, cv::OutputArray dst, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	releaseMapped(dst);
+	dst.create(m_height, m_width, outputType(beReadFourth, depth));
+	cv::Mat img = dst.getMat();
+	return readData(img);
+}
+
+/**
+* read the whole raster into dst and its validity mask into mask (CV_8UC1, 255 valid, 0 nodata
+* or masked), both in the same pass
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, cv::OutputArray dst, cv::OutputArray mask, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	releaseMapped(dst);
+	dst.create(m_height, m_width, outputType(beReadFourth, depth));
+	releaseMapped(mask);
+	mask.create(m_height, m_width, CV_8UC1);
+	cv::Mat img = dst.getMat();
+	return readData(img, mask.getMat());
+}
+
+/**
+* read a window into dst and its validity mask into mask
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst, cv::OutputArray mask, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	if (!checkWindow(xStart, yStart, xWidth, yWidth)) return false;
+
+	releaseMapped(dst);
+	dst.create(yWidth, xWidth, outputType(beReadFourth, depth));
+	releaseMapped(mask);
+	mask.create(yWidth, xWidth, CV_8UC1);
+	cv::Mat img = dst.getMat();
+	cv::Mat validity = mask.getMat();
+	return readWindowStrips(m_dataset, xStart, yStart, img, validity, nullptr);
+}
+
+/**
+* read the whole raster into dst and gather the statistics of every channel in the same pass,
+* GDAL's cached statistics are used instead when there are exact ones and no histogram is needed
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, cv::OutputArray dst, KGDALStats& stats, bool histogram, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	const int type = outputType(beReadFourth, depth);
+	releaseMapped(dst);
+	dst.create(m_height, m_width, type);
+	cv::Mat img = dst.getMat();
+
+	if (!histogram && getCachedStats(m_dataset, type, stats)){
+		return readData(img);
+	}
+
+	const bool binLater = initStats(m_dataset, type, histogram, stats);
+	if (!readData(img, cv::Mat(), &stats)) return false;
+	return !binLater || binStats(m_dataset, 0, 0, img, stats);
+}
+
+/**
+* read a window into dst and gather the statistics of every channel in the same pass
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst, KGDALStats& stats, bool histogram, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	if (!checkWindow(xStart, yStart, xWidth, yWidth)) return false;
+
+	const int type = outputType(beReadFourth, depth);
+	releaseMapped(dst);
+	dst.create(yWidth, xWidth, type);
+	cv::Mat img = dst.getMat();
+	cv::Mat mask;
+
+	const bool binLater = initStats(m_dataset, type, histogram, stats);
+	if (!readWindowStrips(m_dataset, xStart, yStart, img, mask, &stats)) return false;
+	return !binLater || binStats(m_dataset, xStart, yStart, img, stats);
+}
+
+/**
+* read the whole raster stretched to depth (CV_8U or CV_32F) in the same pass that converts it,
+* the stretch is given by the caller or estimated from an overview of the raster
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, cv::OutputArray dst, const KGDALStretch& stretch, int depth, bool beReadFourth)
+{
+	if (depth != CV_8U && depth != CV_32F){
+		std::cout << "A stretch is only read to CV_8U or CV_32F!" << std::endl;
+		return false;
+	}
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	const int type = CV_MAKETYPE(depth, CV_MAT_CN(outputType(beReadFourth, -1)));
+	std::vector<double> low, high, gamma;
+	if (!getStretch(m_dataset, cv::Rect(0, 0, m_width, m_height), CV_MAT_CN(type), stretch, low, high, gamma)){
+		return false;
+	}
+
+	releaseMapped(dst);
+	dst.create(m_height, m_width, type);
+	cv::Mat img = dst.getMat();
+	return readWindowStretch(m_dataset, 0, 0, img, low, high, gamma);
+}
+
+/**
+* read a window stretched to depth (CV_8U or CV_32F), the stretch is estimated over the window
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst, const KGDALStretch& stretch, int depth, bool beReadFourth)
+{
+	if (depth != CV_8U && depth != CV_32F){
+		std::cout << "A stretch is only read to CV_8U or CV_32F!" << std::endl;
+		return false;
+	}
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	if (!checkWindow(xStart, yStart, xWidth, yWidth)) return false;
+
+	const int type = CV_MAKETYPE(depth, CV_MAT_CN(outputType(beReadFourth, -1)));
+	std::vector<double> low, high, gamma;
+	if (!getStretch(m_dataset, cv::Rect(xStart, yStart, xWidth, yWidth), CV_MAT_CN(type), stretch, low, high, gamma)){
+		return false;
+	}
+
+	releaseMapped(dst);
+	dst.create(yWidth, xWidth, type);
+	cv::Mat img = dst.getMat();
+	return readWindowStretch(m_dataset, xStart, yStart, img, low, high, gamma);
+}
+
+// upper bound of a single read of the batch reader
+static const size_t MAX_BATCH_READ_BYTES = 64 << 20;
+
+/**
+* plan the reads of a batch of windows: the blocks touched by any window are grouped into runs
+* along each block row, runs covering the same blocks in consecutive block rows are stacked, and
+* neither runs nor stacks grow past MAX_BATCH_READ_BYTES;
+* every touched block is in exactly one read, so it is decoded once. windowsOfRead lists the
+* windows each read contributes to
+*/
+static void planBatchReads(const std::vector<cv::Rect>& areas, const cv::Rect& raster, const int& blockXSize, const int& blockYSize,
+	const size_t& pixelBytes, std::vector<cv::Rect>& reads, std::vector<std::vector<int> >& windowsOfRead)
+{
+	// touched blocks as (block row, block column), the map keeps them in row-major order
+	std::map<std::pair<int, int>, int> blocks;
+	for (size_t i = 0; i < areas.size(); i++){
+		if (areas[i].area() == 0) continue;
+		for (int by = areas[i].y / blockYSize; by <= (areas[i].y + areas[i].height - 1) / blockYSize; by++){
+			for (int bx = areas[i].x / blockXSize; bx <= (areas[i].x + areas[i].width - 1) / blockXSize; bx++){
+				blocks[std::make_pair(by, bx)] = -1;
+			}
+		}
+	}
+
+	// runs of adjacent blocks of a block row, in blocks, split at the block where a wide row
+	// would exceed the budget on its own
+	const size_t blockBytes = static_cast<size_t>(blockXSize) * blockYSize * pixelBytes;
+	const int maxRunBlocks = static_cast<int>(std::max<size_t>(1, MAX_BATCH_READ_BYTES / std::max<size_t>(1, blockBytes)));
+
+	std::vector<cv::Rect> runs;
+	for (std::map<std::pair<int, int>, int>::iterator it = blocks.begin(); it != blocks.end(); ++it){
+		const int by = it->first.first;
+		const int bx = it->first.second;
+		if (!runs.empty() && runs.back().y == by && runs.back().x + runs.back().width == bx && runs.back().width < maxRunBlocks){
+			runs.back().width++;
+		}
+		else{
+			runs.push_back(cv::Rect(bx, by, 1, 1));
+		}
+	}
+
+	// stack a run onto the read of the same columns that ends right above it
+	std::vector<cv::Rect> blockReads;
+	std::map<std::pair<int, int>, size_t> above;
+	for (size_t r = 0; r < runs.size(); r++){
+		const std::pair<int, int> columns(runs[r].x, runs[r].width);
+		std::map<std::pair<int, int>, size_t>::iterator found = above.find(columns);
+
+		if (found != above.end() && blockReads[found->second].y + blockReads[found->second].height == runs[r].y &&
+			static_cast<size_t>(blockReads[found->second].height + 1) * blockYSize * runs[r].width * blockXSize * pixelBytes <= MAX_BATCH_READ_BYTES){
+			blockReads[found->second].height++;
+		}
+		else{
+			blockReads.push_back(runs[r]);
+			above[columns] = blockReads.size() - 1;
+		}
+	}
+
+	reads.resize(blockReads.size());
+	for (size_t r = 0; r < blockReads.size(); r++){
+		const cv::Rect& read = blockReads[r];
+		reads[r] = cv::Rect(read.x * blockXSize, read.y * blockYSize, read.width * blockXSize, read.height * blockYSize) & raster;
+		for (int by = read.y; by < read.y + read.height; by++){
+			for (int bx = read.x; bx < read.x + read.width; bx++){
+				blocks[std::make_pair(by, bx)] = static_cast<int>(r);
+			}
+		}
+	}
+
+	windowsOfRead.assign(reads.size(), std::vector<int>());
+	for (size_t i = 0; i < areas.size(); i++){
+		if (areas[i].area() == 0) continue;
+		for (int by = areas[i].y / blockYSize; by <= (areas[i].y + areas[i].height - 1) / blockYSize; by++){
+			for (int bx = areas[i].x / blockXSize; bx <= (areas[i].x + areas[i].width - 1) / blockXSize; bx++){
+				std::vector<int>& windows = windowsOfRead[blocks[std::make_pair(by, bx)]];
+				if (windows.empty() || windows.back() != static_cast<int>(i)) windows.push_back(static_cast<int>(i));
+			}
+		}
+	}
+}
+
+/**
+* read a batch of windows with one header read: the windows are merged into block aligned reads
+* that decode every touched block once, and the reads are scattered into one image per window;
+* with SetNumThreads the reads run on a pool of threads. Windows reaching past the raster are
+* cut, windows outside of it get an empty image and make the call return false
+*/
+bool KGDAL2CV::ImgReadByGDAL(const cv::String& filename, const std::vector<cv::Rect>& windows, std::vector<cv::Mat>& images, bool beReadFourth, int depth)
+{
+	if (!checkDepth(depth)) return false;
+
+	m_filename = filename;
+	if (!readHeader()) return false;
+
+	const int type = outputType(beReadFourth, depth);
+	const cv::Rect raster(0, 0, m_width, m_height);
+
+	bool result = true;
+	std::vector<cv::Rect> areas(windows.size());
+	images.assign(windows.size(), cv::Mat());
+	for (size_t i = 0; i < windows.size(); i++){
+		areas[i] = windows[i] & raster;
+		if (areas[i].area() == 0){
+			result = false;
+			continue;
+		}
+		images[i].create(areas[i].height, areas[i].width, type);
+	}
+
+	int blockXSize, blockYSize;
+	m_dataset->GetRasterBand(1)->GetBlockSize(&blockXSize, &blockYSize);
+
+	std::vector<cv::Rect> reads;
+	std::vector<std::vector<int> > windowsOfRead;
+	planBatchReads(areas, raster, std::max(1, blockXSize), std::max(1, blockYSize), CV_ELEM_SIZE(type), reads, windowsOfRead);
+
+	const int nThreads = std::min(getThreadCount(), static_cast<int>(reads.size()));
+	std::atomic<int> nextRead(0);
+	std::atomic<bool> failed(false);
+
+	auto work = [&](GDALDataset* dataset){
+		cv::Mat buffer;
+		for (int index = nextRead++; index < static_cast<int>(reads.size()) && !failed; index = nextRead++){
+			const cv::Rect& read = reads[index];
+			buffer.create(read.height, read.width, type);
+			if (!readWindow(dataset, read.x, read.y, buffer)){
+				failed = true;
+				return;
+			}
+
+			// the reads don't overlap, so the threads copy into disjoint parts of the images
+			for (size_t w = 0; w < windowsOfRead[index].size(); w++){
+				const int i = windowsOfRead[index][w];
+				const cv::Rect part = areas[i] & read;
+				cv::Mat target = images[i](part - areas[i].tl());
+				buffer(part - read.tl()).copyTo(target);
+			}
+		}
+	};
+
+	if (nThreads <= 1){
+		work(m_dataset);
+		return result && !failed;
+	}
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < nThreads; t++){
+		workers.push_back(std::thread([&](){
+			GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+			if (dataset == nullptr){
+				failed = true;
+				return;
+			}
+			work(dataset);
+			KGDALDatasetCache::Instance().Release(dataset);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++){
+		workers[t].join();
+	}
+
+	return result && !failed;
+}
+
+/**
+* check a window of the raster read by readHeader, a window reaching past the raster is cut
+*/
+bool KGDAL2CV::checkWindow(const int& xStart, const int& yStart, int& xWidth, int& yWidth)
+{
+	if (xStart < 0 || yStart < 0 || xWidth < 1 || yWidth < 1 || xStart > m_width - 1 || yStart > m_height - 1) return false;
+
+	if (xStart + xWidth > m_width)
+	{
+		std::cout << "The specified width is invalid, Automatic optimization is executed!" << std::endl;
+		xWidth = m_width - xStart;
+	}
+
+	if (yStart + yWidth > m_height)
+	{
+		std::cout << "The specified height is invalid, Automatic optimization is executed!" << std::endl;
+		yWidth = m_height - yStart;
+	}
+	return true;
+}
+
+
+/**
+* map the file behind the dataset read by readHeader, an empty cv::Mat unless the pixels
+* are stored on disk exactly like a cv::Mat of the type
+*/
+cv::Mat KGDAL2CV::mapData(const int& type)
+{
+	if (hasColorTable || CV_MAT_CN(type) != m_nBand) return cv::Mat();
+
+	// every band has to be the cv::Mat depth bit for bit, in the bgr channel order
+	const GDALDataType dataType = opencv2gdal(CV_MAT_DEPTH(type));
+	for (int b = 1; b <= m_nBand; b++){
+		if (m_dataset->GetRasterBand(b)->GetRasterDataType() != dataType) return cv::Mat();
+	}
+	std::vector<int> bandMap;
+	if (!getBandMap(m_dataset, m_nBand, bandMap)) return cv::Mat();
+	for (int c = 0; c < m_nBand; c++){
+		if (bandMap[c] != c + 1) return cv::Mat();
+	}
+
+	// a handle of our own, it must stay open as long as the mapping
+	GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+	if (dataset == nullptr) return cv::Mat();
+
+	// only a mapping of the file itself, not GDAL's emulation that decodes on page faults
+	char** options = CSLSetNameValue(nullptr, "USE_DEFAULT_IMPLEMENTATION", "NO");
+	int pixelSpace = 0;
+	GIntBig lineSpace = 0;
+	CPLVirtualMem* mem = dataset->GetRasterBand(1)->GetVirtualMemAuto(GF_Read, &pixelSpace, &lineSpace, options);
+	CSLDestroy(options);
+
+	const size_t elemSize = CV_ELEM_SIZE(type);
+	if (mem == nullptr || static_cast<size_t>(pixelSpace) != elemSize ||
+		lineSpace < static_cast<GIntBig>(elemSize) * m_width || lineSpace % CV_ELEM_SIZE1(type) != 0){
+		if (mem != nullptr) CPLVirtualMemFree(mem);
+		KGDALDatasetCache::Instance().Release(dataset);
+		return cv::Mat();
+	}
+
+	uchar* data = static_cast<uchar*>(CPLVirtualMemGetAddr(mem));
+
+	cv::Mat img(m_height, m_width, type, data, static_cast<size_t>(lineSpace));
+	MappedRaster* raster = new MappedRaster;
+	raster->mem = mem;
+	raster->dataset = dataset;
+
+	cv::UMatData* u = new cv::UMatData(&getMappedAllocator());
+	u->data = u->origdata = data;
+	u->size = static_cast<size_t>(lineSpace) * m_height;
+	u->handle = raster;
+	u->refcount = 1;
+	img.u = u;
+	img.allocator = &getMappedAllocator();
+	return img;
+}
+
+/**
+* map an uncompressed raster straight into a read-only cv::Mat, pages are loaded when touched
+* and the mapping lives as long as the cv::Mat; other rasters are read as usual
+*/
+cv::Mat KGDAL2CV::ImgMapByGDAL(const cv::String& filename, bool beReadFourth)
+{
+	m_filename = filename;
+	if (!readHeader()) return cv::Mat();
+
+	cv::Mat img = mapData(outputType(beReadFourth, -1));
+	if (!img.empty()){
+		return img;
+	}
+
+	return ImgReadByGDAL(filename, beReadFourth);
+}
+
+/**
+* create a dataset for the image writers, GTiff datasets are tiled and compress their
+* blocks with the threads of SetNumThreads unless the options say otherwise
+*/
+GDALDataset* KGDAL2CV::CreateByGDAL(const cv::String& filename, int width, int height, int nBand, int depth, const cv::String& driverName, char** options)
+{
+	const GDALDataType dataType = opencv2gdal(depth);
+	if (width < 1 || height < 1 || nBand < 1 || dataType == GDT_Unknown){
+		std::cout << "wrong param!" << std::endl;
+		return nullptr;
+	}
+
+	Initialize();
+	GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(driverName.c_str());
+	if (driver == nullptr){
+		std::cout << "Unknown GDAL driver: " << driverName << std::endl;
+		return nullptr;
+	}
+
+	char** createOptions = CSLDuplicate(options);
+	if (driverName == "GTiff"){
+		if (CSLFetchNameValue(createOptions, "TILED") == nullptr){
+			createOptions = CSLSetNameValue(createOptions, "TILED", "YES");
+		}
+		if (CSLFetchNameValue(createOptions, "NUM_THREADS") == nullptr){
+			createOptions = CSLSetNameValue(createOptions, "NUM_THREADS", CPLSPrintf("%d", getThreadCount()));
+		}
+	}
+
+	// cached reads would still see the old file
+	KGDALDatasetCache::Instance().Invalidate(filename);
+	KGDALTileCache::Instance().Invalidate(filename);
+
+	GDALDataset* dataset = driver->Create(filename.c_str(), width, height, nBand, dataType, createOptions);
+	CSLDestroy(createOptions);
+	return dataset;
+}
+
+/**
+* a MEM dataset whose bands point into the pixels of the image, nothing is copied; the image
+* must outlive the dataset, which is closed with GDALClose
+*/
+GDALDataset* KGDAL2CV::WrapByGDAL(cv::Mat img, bool isBGR)
+{
+	const GDALDataType dataType = opencv2gdal(img.depth());
+	if (img.empty() || dataType == GDT_Unknown){
+		std::cout << "wrong param!" << std::endl;
+		return nullptr;
+	}
+
+	Initialize();
+	GDALDriver* driver = GetGDALDriverManager()->GetDriverByName("MEM");
+	if (driver == nullptr){
+		std::cout << "Unknown GDAL driver: MEM" << std::endl;
+		return nullptr;
+	}
+
+	GDALDataset* dataset = driver->Create("", img.cols, img.rows, 0, dataType, nullptr);
+	if (dataset == nullptr){
+		return nullptr;
+	}
+
+	const int nBand = img.channels();
+	for (int b = 0; b < nBand; b++){
+
+		// band b + 1 is channel c, the first three are reversed for a bgr image
+		const int c = (isBGR && nBand >= 3 && b < 3) ? 2 - b : b;
+
+		char pointer[64] = { 0 };
+		CPLPrintPointer(pointer, img.ptr<uchar>(0) + c * img.elemSize1(), sizeof(pointer) - 1);
+
+		char** options = nullptr;
+		options = CSLSetNameValue(options, "DATAPOINTER", pointer);
+		options = CSLSetNameValue(options, "PIXELOFFSET", std::to_string(img.elemSize()).c_str());
+		options = CSLSetNameValue(options, "LINEOFFSET", std::to_string(img.step[0]).c_str());
+		const CPLErr err = dataset->AddBand(dataType, options);
+		CSLDestroy(options);
+
+		if (err != CE_None){
+			GDALClose(static_cast<GDALDatasetH>(dataset));
+			return nullptr;
+		}
+	}
+
+	if (isBGR && nBand >= 3){
+		dataset->GetRasterBand(1)->SetColorInterpretation(GCI_RedBand);
+		dataset->GetRasterBand(2)->SetColorInterpretation(GCI_GreenBand);
+		dataset->GetRasterBand(3)->SetColorInterpretation(GCI_BlueBand);
+	}
+	return dataset;
+}
+
+/**
+* a /vsimem/ file name no other call uses
+*/
+static std::string getMemFilename(const char* extension)
+{
+	static std::atomic<unsigned int> counter(0);
+	std::string filename = "/vsimem/kgdal2cv_" + std::to_string(counter++);
+	if (extension != nullptr && extension[0] != 0){
+		filename = filename + "." + extension;
+	}
+	return filename;
+}
+
+/**
+* encode the image with a GDAL driver (PNG, JPEG, COG, GTiff ...) into buf without touching
+* the disk: the image is wrapped by WrapByGDAL and CreateCopy writes a /vsimem/ file
+*/
+bool KGDAL2CV::EncodeByGDAL(const cv::String& driverName, const cv::Mat img, std::vector<uchar>& buf, char** options, bool isBGR)
+{
+	GDALDataset* source = WrapByGDAL(img, isBGR);
+	if (source == nullptr){
+		return false;
+	}
+
+	GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(driverName.c_str());
+	if (driver == nullptr){
+		std::cout << "Unknown GDAL driver: " << driverName << std::endl;
+		GDALClose(static_cast<GDALDatasetH>(source));
+		return false;
+	}
+
+	const std::string filename = getMemFilename(driver->GetMetadataItem(GDAL_DMD_EXTENSION));
+	GDALDataset* target = driver->CreateCopy(filename.c_str(), source, FALSE, options, nullptr, nullptr);
+	GDALClose(static_cast<GDALDatasetH>(source));
+	if (target != nullptr){
+		GDALClose(static_cast<GDALDatasetH>(target));
+	}
+
+	// take the buffer over, the side car of formats without georeferencing is dropped
+	vsi_l_offset size = 0;
+	GByte* data = VSIGetMemFileBuffer(filename.c_str(), &size, TRUE);
+	VSIUnlink((filename + ".aux.xml").c_str());
+	if (data == nullptr){
+		return false;
+	}
+
+	if (target != nullptr){
+		buf.assign(data, data + size);
+	}
+	VSIFree(data);
+	return target != nullptr;
+}
+
+/**
+* decode an image in any format GDAL reads, the buffer is read in place through a /vsimem/ file
+*/
+cv::Mat KGDAL2CV::DecodeByGDAL(cv::InputArray buf, bool beReadFourth, int depth)
+{
+	cv::Mat data = buf.getMat();
+	if (data.empty() || !data.isContinuous()){
+		std::cout << "wrong param!" << std::endl;
+		return cv::Mat();
+	}
+
+	const std::string filename = getMemFilename(nullptr);
+	VSILFILE* file = VSIFileFromMemBuffer(filename.c_str(), data.ptr<GByte>(0), static_cast<vsi_l_offset>(data.total() * data.elemSize()), FALSE);
+	if (file == nullptr){
+		return cv::Mat();
+	}
+	VSIFCloseL(file);
+
+	cv::Mat img;
+	if (!ImgReadByGDAL(cv::String(filename.c_str()), img, beReadFourth, depth)) img.release();
+
+	// no handle may outlive the buffer
+	Close();
+	m_filename = "";
+	KGDALDatasetCache::Instance().Invalidate(filename.c_str());
+	KGDALTileCache::Instance().Invalidate(filename.c_str());
+	VSIUnlink(filename.c_str());
+	return img;
+}
+
+/**
+* set an option unless the caller already did
+*/
+static char** setDefaultOption(char** options, const char* key, const char* value)
+{
+	return CSLFetchNameValue(options, key) == nullptr ? CSLSetNameValue(options, key, value) : options;
+}
+
+/**
+* creation options of the tiled, uncompressed GTiff a COG is copied from
+*/
+static char** getTileOptions(const int& blockSize)
+{
+	char** options = nullptr;
+	options = CSLSetNameValue(options, "BLOCKXSIZE", CPLSPrintf("%d", blockSize));
+	options = CSLSetNameValue(options, "BLOCKYSIZE", CPLSPrintf("%d", blockSize));
+	options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+	return options;
+}
+
+/**
+* write the image as a Cloud-Optimized GeoTIFF; with the COG driver (GDAL 3.1) the image is
+* read in place, otherwise it goes through a temporary tiled GTiff next to the file
+*/
+bool KGDAL2CV::WriteCOGByGDAL(const cv::String& filename, const cv::Mat img, const cv::String& compress, int blockSize, bool isBGR, char** options)
+{
+	if (img.empty() || blockSize < 16 || blockSize % 16 != 0){
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+
+	Initialize();
+	if (GetGDALDriverManager()->GetDriverByName("COG") != nullptr){
+		GDALDataset* source = WrapByGDAL(img, isBGR);
+		if (source == nullptr){
+			return false;
+		}
+		const bool ret = writeCOG(filename, source, compress, blockSize, options);
+		GDALClose(static_cast<GDALDatasetH>(source));
+		return ret;
+	}
+
+	const cv::String tempname = filename + ".tmp.tif";
+	char** tileOptions = getTileOptions(blockSize);
+	GDALDataset* temp = CreateByGDAL(tempname, img.cols, img.rows, img.channels(), img.depth(), "GTiff", tileOptions);
+	CSLDestroy(tileOptions);
+	if (temp == nullptr){
+		return false;
+	}
+
+	const bool ret = ImgWriteByGDAL(temp, img, 0, 0, isBGR) && writeCOG(filename, temp, compress, blockSize, options);
+	GDALClose(static_cast<GDALDatasetH>(temp));
+	GetGDALDriverManager()->GetDriverByName("GTiff")->Delete(tempname.c_str());
+	return ret;
+}
+
+/**
+* write a COG from a stream of tiles, tileSource fills the blockSize tiles in row-major order
+* (the tile is allocated at the size of the window and type); the tiles are gathered in a
+* temporary tiled GTiff next to the file
+*/
+bool KGDAL2CV::WriteCOGByGDAL(const cv::String& filename, int width, int height, int type, const std::function<bool(const cv::Rect&, cv::Mat&)>& tileSource,
+	const cv::String& compress, int blockSize, bool isBGR, char** options)
+{
+	if (width < 1 || height < 1 || !tileSource || blockSize < 16 || blockSize % 16 != 0){
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+
+	const cv::String tempname = filename + ".tmp.tif";
+	char** tileOptions = getTileOptions(blockSize);
+	GDALDataset* temp = CreateByGDAL(tempname, width, height, CV_MAT_CN(type), CV_MAT_DEPTH(type), "GTiff", tileOptions);
+	CSLDestroy(tileOptions);
+	if (temp == nullptr){
+		return false;
+	}
+
+	// channel index -> band number, the first three are reversed for a bgr image
+	const int nBand = CV_MAT_CN(type);
+	std::vector<int> bandMap(nBand);
+	for (int index = 0; index < nBand; ++index) bandMap[index] = index + 1;
+	if (isBGR && nBand >= 3)
+	{
+		bandMap[0] = 3;
+		bandMap[2] = 1;
+	}
+
+	// the temporary file is private, the tiles go straight into it and the cache is flushed once
+	bool ret = true;
+	cv::Mat tile;
+	for (int y = 0; y < height && ret; y += blockSize){
+		for (int x = 0; x < width && ret; x += blockSize){
+			const cv::Rect window = cv::Rect(x, y, blockSize, blockSize) & cv::Rect(0, 0, width, height);
+			tile.create(window.height, window.width, type);
+			ret = tileSource(window, tile) && tile.size() == window.size() && tile.type() == type &&
+				writeDatasetNative(temp, window.x, window.y, tile, bandMap);
+		}
+	}
+	temp->FlushCache();
+
+	ret = ret && writeCOG(filename, temp, compress, blockSize, options);
+	GDALClose(static_cast<GDALDatasetH>(temp));
+	GetGDALDriverManager()->GetDriverByName("GTiff")->Delete(tempname.c_str());
+	return ret;
+}
+
+/**
+* copy the source into a COG: compress is DEFLATE, ZSTD, LZW, JPEG or NONE, lossless ones get
+* the predictor that suits the data type, and the tiles are compressed on NUM_THREADS threads
+* (SetNumThreads); without the COG driver the overviews are built with OpenCV and copied
+* with COPY_SRC_OVERVIEWS, which puts all the IFDs ahead of the tile data
+*/
+bool KGDAL2CV::writeCOG(const cv::String& filename, GDALDataset* source, const cv::String& compress, const int& blockSize, char** options)
+{
+	GDALDriver* cog = GetGDALDriverManager()->GetDriverByName("COG");
+	GDALDriver* driver = cog != nullptr ? cog : GetGDALDriverManager()->GetDriverByName("GTiff");
+	if (driver == nullptr){
+		std::cout << "Unknown GDAL driver: GTiff" << std::endl;
+		return false;
+	}
+
+	const GDALDataType dataType = source->GetRasterBand(1)->GetRasterDataType();
+	const bool floating = dataType == GDT_Float32 || dataType == GDT_Float64;
+	const bool predictor = compress == "DEFLATE" || compress == "ZSTD" || compress == "LZW";
+
+	char** copyOptions = CSLDuplicate(options);
+	copyOptions = setDefaultOption(copyOptions, "COMPRESS", compress.c_str());
+	copyOptions = setDefaultOption(copyOptions, "NUM_THREADS", CPLSPrintf("%d", getThreadCount()));
+	copyOptions = setDefaultOption(copyOptions, "BIGTIFF", "IF_SAFER");
+
+	if (cog != nullptr){
+		// the driver lays out the tiles, the overviews and the IFDs itself
+		copyOptions = setDefaultOption(copyOptions, "BLOCKSIZE", CPLSPrintf("%d", blockSize));
+		copyOptions = setDefaultOption(copyOptions, "OVERVIEW_RESAMPLING", "AVERAGE");
+		if (predictor) copyOptions = setDefaultOption(copyOptions, "PREDICTOR", "YES");
+	}
+	else{
+		// halve until the coarsest level fits into a single tile
+		std::vector<int> levels;
+		const int size = std::max(source->GetRasterXSize(), source->GetRasterYSize());
+		for (int level = 2; size > blockSize * (level / 2); level *= 2){
+			levels.push_back(level);
+		}
+		if (!levels.empty() && !BuildOverviews(source, levels)){
+			CSLDestroy(copyOptions);
+			return false;
+		}
+
+		copyOptions = setDefaultOption(copyOptions, "TILED", "YES");
+		copyOptions = setDefaultOption(copyOptions, "BLOCKXSIZE", CPLSPrintf("%d", blockSize));
+		copyOptions = setDefaultOption(copyOptions, "BLOCKYSIZE", CPLSPrintf("%d", blockSize));
+		copyOptions = setDefaultOption(copyOptions, "COPY_SRC_OVERVIEWS", "YES");
+		if (predictor) copyOptions = setDefaultOption(copyOptions, "PREDICTOR", floating ? "3" : "2");
+		if (compress == "JPEG" && source->GetRasterCount() == 3) copyOptions = setDefaultOption(copyOptions, "PHOTOMETRIC", "YCBCR");
+	}
+
+	// cached reads would still see the old file
+	KGDALDatasetCache::Instance().Invalidate(filename);
+	KGDALTileCache::Instance().Invalidate(filename);
+
+	GDALDataset* target = driver->CreateCopy(filename.c_str(), source, FALSE, copyOptions, nullptr, nullptr);
+	CSLDestroy(copyOptions);
+	if (target == nullptr){
+		std::cout << "Failed to write the COG: " << filename << std::endl;
+		return false;
+	}
+	GDALClose(static_cast<GDALDatasetH>(target));
+	return true;
+}
+
+/**
+* build the overview pyramid of the dataset with OpenCV, every level is downsampled from the
+* previous one tile by tile on the thread pool (SetNumThreads); GDAL only creates the empty
+* overview bands, internal ones for a dataset opened for update, an external .ovr otherwise
+*/
+bool KGDAL2CV::BuildOverviews(GDALDataset* dataset, std::vector<int> levels, int interpolation)
+{
+	if (dataset == nullptr || dataset->GetRasterCount() <= 0){
+		return false;
+	}
+
+	std::sort(levels.begin(), levels.end());
+	levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+	if (levels.empty() || levels[0] < 2){
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+
+	if (CE_None != dataset->BuildOverviews("NONE", static_cast<int>(levels.size()), &levels[0], 0, nullptr, nullptr, nullptr)){
+		std::cout << "Failed to create the overviews!" << std::endl;
+		return false;
+	}
+
+	const int width = dataset->GetRasterXSize();
+	const int height = dataset->GetRasterYSize();
+
+	for (int b = 1; b <= dataset->GetRasterCount(); b++){
+		GDALRasterBand* band = dataset->GetRasterBand(b);
+		const int type = gdal2opencv(band->GetRasterDataType(), 1);
+		if (type < 0){
+			return false;
+		}
+
+		// 32 bit integers are resampled as doubles, unsigned ones don't fit into CV_32S
+		const int depth = CV_MAT_DEPTH(type) == CV_32S ? CV_64F : CV_MAT_DEPTH(type);
+
+		// averaged palette indices are meaningless
+		const int bandInterpolation = band->GetColorInterpretation() == GCI_PaletteIndex ? cv::INTER_NEAREST : interpolation;
+
+		GDALRasterBand* source = band;
+		for (size_t l = 0; l < levels.size(); l++){
+			GDALRasterBand* target = getOverviewBySize(band, (width + levels[l] - 1) / levels[l], (height + levels[l] - 1) / levels[l]);
+			if (target == nullptr || !buildOverviewLevel(source, target, depth, bandInterpolation)){
+				return false;
+			}
+			source = target;
+		}
+	}
+
+	dataset->FlushCache();
+
+	// cached read handles don't know the new overviews
+	KGDALDatasetCache::Instance().Invalidate(dataset->GetDescription());
+	return true;
+}
+
+void KGDAL2CV::SetNumThreads(int nThreads)
+{
+	m_nThreads = std::max(0, nThreads);
+}
+
+int KGDAL2CV::getThreadCount() const
+{
+	if (m_nThreads > 0){
+		return m_nThreads;
+	}
+	return std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+void KGDAL2CV::Close()
+{
+	if (nullptr != m_dataset) KGDALDatasetCache::Instance().Release(m_dataset);
+	m_dataset = nullptr;
+	m_driver = nullptr;
+}
+
+/**
+* GDAL is set up with the default options unless Initialize was called before, only the
+* first call does anything
+*/
+KGDAL2CV::KGDAL2CV() : m_dataset(nullptr), m_filename(""), m_driver(nullptr), hasColorTable(false), m_width(0), m_height(0), m_type(-1), m_nBand(0), m_nThreads(1)
+{
+	Initialize();
+}
+
+KGDALInitOptions::KGDALInitOptions() : cacheBytes(0), numThreads(0)
+{
+}
+
+// drivers that every GDAL build has and can be registered on their own, optional ones (HFA,
+// ENVI, ...) may be left out of a build and are only reached through GDALAllRegister
+static const struct
+{
+	const char* name;
+	void(*reg)();
+} BUILTIN_DRIVERS[] = {
+	{ "GTiff", GDALRegister_GTiff },
+	{ "VRT", GDALRegister_VRT },
+	{ "MEM", GDALRegister_MEM },
+};
+
+/**
+* register the drivers and configure GDAL, only the first call in the process does anything
+* and returns true; every KGDAL2CV calls it without options when it is constructed, so the
+* options must be given before the first KGDAL2CV exists, later options are ignored with a warning
+*/
+bool KGDAL2CV::Initialize(const KGDALInitOptions& options)
+{
+	static std::once_flag once;
+	bool applied = false;
+
+	std::call_once(once, [&](){
+		CPLSetConfigOption("GDAL_FILENAME_IS_UTF8", "NO");
+
+		if (options.cacheBytes > 0){
+			GDALSetCacheMax64(static_cast<GIntBig>(options.cacheBytes));
+		}
+		if (options.numThreads != 0){
+			CPLSetConfigOption("GDAL_NUM_THREADS", options.numThreads < 0 ? "ALL_CPUS" : std::to_string(options.numThreads).c_str());
+		}
+
+		bool registerAll = options.drivers.empty();
+		for (size_t i = 0; i < options.drivers.size() && !registerAll; i++){
+			size_t d = 0;
+			const size_t count = sizeof(BUILTIN_DRIVERS) / sizeof(BUILTIN_DRIVERS[0]);
+			while (d < count && options.drivers[i] != BUILTIN_DRIVERS[d].name) d++;
+
+			if (d == count){
+				std::cout << "Note: the driver " << options.drivers[i] << " is registered with all the other drivers." << std::endl;
+				registerAll = true;
+			}
+			else{
+				BUILTIN_DRIVERS[d].reg();
+			}
+		}
+		if (registerAll){
+			GDALAllRegister();
+		}
+		applied = true;
+	});
+
+	if (!applied && (!options.drivers.empty() || options.cacheBytes > 0 || options.numThreads != 0)){
+		std::cout << "GDAL is already initialized, the options are ignored!" << std::endl;
+	}
+	return applied;
+}
+
+KGDAL2CV::~KGDAL2CV()
+{
+	Close();
+}
+
+KGDALTileIterator::KGDALTileIterator() : m_tileWidth(0), m_tileHeight(0), m_overlap(0), m_halo(0), m_type(-1), m_nCols(0), m_nRows(0), m_index(0)
+{
+}
+
+KGDALTileIterator::~KGDALTileIterator()
+{
+	Close();
+}
+
+/**
+* open the raster and prepare the tiles, neighbouring tiles share overlap pixels and every
+* tile is read together with a border of halo pixels (clipped to the raster)
+*/
+bool KGDALTileIterator::Open(const cv::String& filename, int tileWidth, int tileHeight, int overlap, int halo, bool beReadFourth, int depth)
+{
+	Close();
+
+	if (tileWidth < 1 || tileHeight < 1 || overlap < 0 || halo < 0 || overlap >= tileWidth || overlap >= tileHeight){
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+	if (!m_reader.checkDepth(depth)) return false;
+
+	m_reader.m_filename = filename;
+	if (!m_reader.readHeader()){
+		m_reader.Close();
+		return false;
+	}
+
+	m_tileWidth = tileWidth;
+	m_tileHeight = tileHeight;
+	m_overlap = overlap;
+	m_halo = halo;
+	m_type = m_reader.outputType(beReadFourth, depth);
+
+	// tiles start every (size - overlap) pixels until the raster is covered
+	const int xStep = m_tileWidth - m_overlap;
+	const int yStep = m_tileHeight - m_overlap;
+	m_nCols = std::max(1, (std::max(0, m_reader.m_width - m_tileWidth) + xStep - 1) / xStep + 1);
+	m_nRows = std::max(1, (std::max(0, m_reader.m_height - m_tileHeight) + yStep - 1) / yStep + 1);
+	m_index = 0;
+
+	// the one buffer every tile is read into
+	m_buffer.create(m_tileHeight + 2 * m_halo, m_tileWidth + 2 * m_halo, m_type);
+	return true;
+}
+
+/**
+* read the next tile in row-major order, tile.image is a view into the buffer of the
+* iterator and is overwritten by the next call
+*/
+bool KGDALTileIterator::Next(KGDALTile& tile)
+{
+	if (m_reader.m_dataset == nullptr || m_index >= Count()){
+		return false;
+	}
+
+	const cv::Rect raster(0, 0, m_reader.m_width, m_reader.m_height);
+	const int col = m_index % m_nCols;
+	const int row = m_index / m_nCols;
+
+	tile.core = cv::Rect(col * (m_tileWidth - m_overlap), row * (m_tileHeight - m_overlap), m_tileWidth, m_tileHeight) & raster;
+	tile.window = cv::Rect(tile.core.x - m_halo, tile.core.y - m_halo, tile.core.width + 2 * m_halo, tile.core.height + 2 * m_halo) & raster;
+	tile.image = m_buffer(cv::Rect(0, 0, tile.window.width, tile.window.height));
+
+	if (!KGDAL2CV::readWindowCached(m_reader.m_filename, m_reader.m_dataset, tile.window.x, tile.window.y, tile.image)){
+		tile.image.release();
+		return false;
+	}
+
+	m_index++;
+	return true;
+}
+
+void KGDALTileIterator::Reset()
+{
+	m_index = 0;
+}
+
+int KGDALTileIterator::Count() const
+{
+	return m_nCols * m_nRows;
+}
+
+void KGDALTileIterator::Close()
+{
+	m_reader.Close();
+	m_buffer.release();
+	m_nCols = 0;
+	m_nRows = 0;
+	m_index = 0;
+}
+
+KGDALAsyncReader::KGDALAsyncReader() : m_type(-1), m_prefetch(0), m_nIssued(0), m_nRead(0), m_stop(false)
+{
+}
+
+KGDALAsyncReader::~KGDALAsyncReader()
+{
+	Close();
+}
+
+/**
+* open the raster and start the I/O thread, at most prefetch tiles of the scan order
+* are read ahead of the consumer
+*/
+bool KGDALAsyncReader::Open(const cv::String& filename, int prefetch, bool beReadFourth, int depth)
+{
+	Close();
+
+	if (prefetch < 1){
+		std::cout << "wrong param!" << std::endl;
+		return false;
+	}
+	if (!m_reader.checkDepth(depth)) return false;
+
+	m_reader.m_filename = filename;
+	if (!m_reader.readHeader()){
+		m_reader.Close();
+		return false;
+	}
+
+	m_type = m_reader.outputType(beReadFourth, depth);
+	m_prefetch = prefetch;
+	m_stop = false;
+	m_thread = std::thread(&KGDALAsyncReader::run, this);
+	return true;
+}
+
+/**
+* queue a window read, blocks while prefetch requests are still waiting for the I/O thread
+*/
+std::future<cv::Mat> KGDALAsyncReader::Submit(int xStart, int yStart, int xWidth, int yWidth)
+{
+	std::promise<cv::Mat> promise;
+	std::future<cv::Mat> future = promise.get_future();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_spaceCond.wait(lock, [this](){ return m_stop || static_cast<int>(m_requests.size()) < m_prefetch; });
+	if (m_stop || !m_thread.joinable()){
+		promise.set_value(cv::Mat());
+		return future;
+	}
+
+	m_requests.push_back(Request());
+	m_requests.back().window = cv::Rect(xStart, yStart, xWidth, yWidth);
+	m_requests.back().promise = std::move(promise);
+	m_workCond.notify_one();
+	return future;
+}
+
+/**
+* replace the scan order, its tiles are handed out by Next() in the same order
+*/
+bool KGDALAsyncReader::Start(const std::vector<cv::Rect>& scanOrder)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_thread.joinable()){
+		return false;
+	}
+
+	m_scan.clear();
+	m_scanFutures.clear();
+	for (size_t i = 0; i < scanOrder.size(); i++){
+		m_scan.push_back(Request());
+		m_scan.back().window = scanOrder[i];
+		m_scanFutures.push_back(m_scan.back().promise.get_future());
+	}
+	m_nIssued = 0;
+	m_nRead = 0;
+	m_workCond.notify_one();
+	return true;
+}
+
+/**
+* the future of the next tile of the scan order, invalid once the scan is done; taking it
+* lets the I/O thread read one more tile ahead
+*/
+std::future<cv::Mat> KGDALAsyncReader::Next()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_scanFutures.empty()){
+		return std::future<cv::Mat>();
+	}
+
+	std::future<cv::Mat> future = std::move(m_scanFutures.front());
+	m_scanFutures.pop_front();
+	m_nIssued++;
+	m_workCond.notify_one();
+	return future;
+}
+
+void KGDALAsyncReader::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_workCond.notify_all();
+	m_spaceCond.notify_all();
+	if (m_thread.joinable()){
+		m_thread.join();
+	}
+
+	// the futures of unread requests report a broken promise
+	m_requests.clear();
+	m_scan.clear();
+	m_scanFutures.clear();
+	m_nIssued = 0;
+	m_nRead = 0;
+	m_reader.Close();
+}
+
+/**
+* the I/O thread, submitted windows go first, then the scan order as far as the read-ahead allows
+*/
+void KGDALAsyncReader::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;){
+		m_workCond.wait(lock, [this](){
+			return m_stop || !m_requests.empty() || (!m_scan.empty() && m_nRead < m_nIssued + m_prefetch);
+		});
+		if (m_stop){
+			return;
+		}
+
+		Request request;
+		if (!m_requests.empty()){
+			request = std::move(m_requests.front());
+			m_requests.pop_front();
+			m_spaceCond.notify_one();
+		}
+		else{
+			request = std::move(m_scan.front());
+			m_scan.pop_front();
+			m_nRead++;
+		}
+
+		// decode without holding the lock, so the consumer keeps going
+		lock.unlock();
+		try{
+			request.promise.set_value(read(request.window));
+		}
+		catch (...){
+			request.promise.set_exception(std::current_exception());
+		}
+		lock.lock();
+	}
+}
+
+/**
+* read a window the same way as the windowed ImgReadByGDAL does
+*/
+cv::Mat KGDALAsyncReader::read(cv::Rect window)
+{
+	const int width = m_reader.m_width;
+	const int height = m_reader.m_height;
+
+	if (window.x < 0 || window.y < 0 || window.width < 1 || window.height < 1 || window.x > width - 1 || window.y > height - 1) return cv::Mat();
+	window &= cv::Rect(0, 0, width, height);
+
+	cv::Mat img(window.height, window.width, m_type);
+	if (!KGDAL2CV::readWindowCached(m_reader.m_filename, m_reader.m_dataset, window.x, window.y, img)){
+		return cv::Mat();
+	}
+	return img;
+}
+
+KGDALReader::KGDALReader() : m_filename(""), m_width(0), m_height(0), m_type(-1)
+{
+}
+
+/**
+* read the header of the raster once, the handle is given back right away
+*/
+bool KGDALReader::Open(const cv::String& filename, bool beReadFourth, int depth)
 {
 	Close();
+
+	KGDAL2CV header;
+	if (!KGDAL2CV::checkDepth(depth)) return false;
+
+	header.m_filename = filename;
+	if (!header.readHeader()) return false;
+
+	m_filename = filename;
+	m_width = header.m_width;
+	m_height = header.m_height;
+	m_type = header.outputType(beReadFourth, depth);
+	return true;
+}
+
+/**
+* check a window, one reaching past the raster is cut; nothing is printed since the
+* reads run on many threads
+*/
+bool KGDALReader::getWindow(int xStart, int yStart, int xWidth, int yWidth, cv::Rect& window) const
+{
+	if (m_filename.empty() || xStart < 0 || yStart < 0 || xWidth < 1 || yWidth < 1 || xStart > m_width - 1 || yStart > m_height - 1){
+		return false;
+	}
+	window = cv::Rect(xStart, yStart, xWidth, yWidth) & cv::Rect(0, 0, m_width, m_height);
+	return true;
+}
+
+/**
+* read a window into dst, through the tile cache when it has a budget
+*/
+bool KGDALReader::Read(int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst) const
+{
+	cv::Rect window;
+	if (!getWindow(xStart, yStart, xWidth, yWidth, window)) return false;
+
+	GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+	if (dataset == nullptr) return false;
+
+	releaseMapped(dst);
+	dst.create(window.height, window.width, m_type);
+	cv::Mat img = dst.getMat();
+	const bool result = KGDAL2CV::readWindowCached(m_filename, dataset, window.x, window.y, img);
+
+	KGDALDatasetCache::Instance().Release(dataset);
+	return result;
+}
+
+/**
+* read a window into dst and its validity mask into mask
+*/
+bool KGDALReader::Read(int xStart, int yStart, int xWidth, int yWidth, cv::OutputArray dst, cv::OutputArray mask) const
+{
+	cv::Rect window;
+	if (!getWindow(xStart, yStart, xWidth, yWidth, window)) return false;
+
+	GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+	if (dataset == nullptr) return false;
+
+	releaseMapped(dst);
+	dst.create(window.height, window.width, m_type);
+	releaseMapped(mask);
+	mask.create(window.height, window.width, CV_8UC1);
+	cv::Mat img = dst.getMat();
+	cv::Mat validity = mask.getMat();
+	const bool result = KGDAL2CV::readWindowStrips(dataset, window.x, window.y, img, validity, nullptr);
+
+	KGDALDatasetCache::Instance().Release(dataset);
+	return result;
+}
+
+/**
+* read a window resampled to dsize, from the best overview
+*/
+bool KGDALReader::Read(int xStart, int yStart, int xWidth, int yWidth, cv::Size dsize, cv::OutputArray dst, int interpolation) const
+{
+	cv::Rect window;
+	if (!getWindow(xStart, yStart, xWidth, yWidth, window) || dsize.width < 1 || dsize.height < 1) return false;
+
+	GDALDataset* dataset = KGDALDatasetCache::Instance().Acquire(m_filename);
+	if (dataset == nullptr) return false;
+
+	releaseMapped(dst);
+	dst.create(dsize, m_type);
+	cv::Mat img = dst.getMat();
+	const bool result = KGDAL2CV::readWindowScaled(dataset, window, img, interpolation);
+
+	KGDALDatasetCache::Instance().Release(dataset);
+	return result;
+}
+
+cv::Mat KGDALReader::Read(int xStart, int yStart, int xWidth, int yWidth) const
+{
+	cv::Mat img;
+	if (!Read(xStart, yStart, xWidth, yWidth, img)) img.release();
+	return img;
+}
+
+int KGDALReader::Width() const
+{
+	return m_width;
+}
+
+int KGDALReader::Height() const
+{
+	return m_height;
+}
+
+int KGDALReader::Type() const
+{
+	return m_type;
+}
+
+void KGDALReader::Close()
+{
+	m_filename = "";
+	m_width = 0;
+	m_height = 0;
+	m_type = -1;
+}
+
+KGDALDatasetCache::KGDALDatasetCache() : m_capacity(64), m_hits(0), m_misses(0)
+{
+}
+
+KGDALDatasetCache::~KGDALDatasetCache()
+{
+	Clear();
+}
+
+KGDALDatasetCache& KGDALDatasetCache::Instance()
+{
+	static KGDALDatasetCache cache;
+	return cache;
+}
+
+/**
+* lease an open dataset for the file, a handle is only ever leased to one user at a time
+* since GDALDataset isn't thread-safe, so busy files get several handles
+*/
+GDALDataset* KGDALDatasetCache::Acquire(const cv::String& filename)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it){
+			if (it->refCount == 0 && it->filename == filename){
+				it->refCount++;
+				m_entries.splice(m_entries.begin(), m_entries, it);
+				m_hits++;
+				return it->dataset;
+			}
+		}
+		m_misses++;
+	}
+
+	// open outside the lock, other files keep being served meanwhile
+	KGDAL2CV::Initialize();
+	GDALDataset* dataset = static_cast<GDALDataset*>(GDALOpen(filename.c_str(), GA_ReadOnly));
+	if (dataset == nullptr){
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Entry entry;
+	entry.filename = filename;
+	entry.dataset = dataset;
+	entry.refCount = 1;
+	m_entries.push_front(entry);
+	trim();
+	return dataset;
+}
+
+/**
+* give a leased dataset back, it stays open for the next Acquire until it falls out of the cache
+*/
+void KGDALDatasetCache::Release(GDALDataset* dataset)
+{
+	if (dataset == nullptr) return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end(); ++it){
+		if (it->dataset != dataset) continue;
+
+		if (--it->refCount == 0 && it->filename.empty()){
+			// invalidated while leased
+			GDALClose(static_cast<GDALDatasetH>(it->dataset));
+			m_entries.erase(it);
+		}
+		else{
+			m_entries.splice(m_entries.begin(), m_entries, it);
+			trim();
+		}
+		return;
+	}
+
+	// not ours
+	GDALClose(static_cast<GDALDatasetH>(dataset));
+}
+
+/**
+* drop the handles of a file that is about to be rewritten, leased ones are closed on release
+*/
+void KGDALDatasetCache::Invalidate(const cv::String& filename)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end();){
+		if (it->filename != filename){
+			++it;
+		}
+		else if (it->refCount == 0){
+			GDALClose(static_cast<GDALDatasetH>(it->dataset));
+			it = m_entries.erase(it);
+		}
+		else{
+			it->filename = cv::String();
+			++it;
+		}
+	}
+}
+
+/**
+* maximum number of open datasets, leased handles are never closed so the cache can be over
+* the limit until they are released; 0 closes every handle on release
+*/
+void KGDALDatasetCache::SetCapacity(int capacity)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capacity = std::max(capacity, 0);
+	trim();
+}
+
+int KGDALDatasetCache::GetCapacity() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_capacity;
+}
+
+size_t KGDALDatasetCache::Hits() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+size_t KGDALDatasetCache::Misses() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+/**
+* close every idle dataset and reset the counters
+*/
+void KGDALDatasetCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end();){
+		if (it->refCount == 0){
+			GDALClose(static_cast<GDALDatasetH>(it->dataset));
+			it = m_entries.erase(it);
+		}
+		else{
+			++it;
+		}
+	}
+	m_hits = 0;
+	m_misses = 0;
+}
+
+/**
+* close the least recently used idle datasets until the cache fits, the caller holds the lock
+*/
+void KGDALDatasetCache::trim()
+{
+	std::list<Entry>::iterator it = m_entries.end();
+	while (static_cast<int>(m_entries.size()) > m_capacity && it != m_entries.begin()){
+		--it;
+		if (it->refCount == 0){
+			GDALClose(static_cast<GDALDatasetH>(it->dataset));
+			it = m_entries.erase(it);
+		}
+	}
+}
+
+bool KGDALTileCache::Key::operator<(const Key& other) const
+{
+	if (filename != other.filename) return filename < other.filename;
+	if (type != other.type) return type < other.type;
+	if (y != other.y) return y < other.y;
+	return x < other.x;
+}
+
+KGDALTileCache::KGDALTileCache() : m_budget(0), m_usage(0), m_hits(0), m_misses(0)
+{
+}
+
+KGDALTileCache& KGDALTileCache::Instance()
+{
+	static KGDALTileCache cache;
+	return cache;
+}
+
+/**
+* look up the decoded tile of the file at the output type, the tile must not be modified
+*/
+bool KGDALTileCache::Get(const cv::String& filename, const int& type, const cv::Rect& area, cv::Mat& tile)
+{
+	Key key = { filename, type, area.x, area.y };
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<Key, std::list<Entry>::iterator>::iterator it = m_index.find(key);
+	if (it == m_index.end() || it->second->tile.size() != area.size()){
+		m_misses++;
+		return false;
+	}
+
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	tile = it->second->tile;
+	m_hits++;
+	return true;
+}
+
+void KGDALTileCache::Put(const cv::String& filename, const int& type, const cv::Rect& area, const cv::Mat& tile)
+{
+	const size_t bytes = tile.total() * tile.elemSize();
+	Key key = { filename, type, area.x, area.y };
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (bytes > m_budget) return;
+
+	std::map<Key, std::list<Entry>::iterator>::iterator it = m_index.find(key);
+	if (it != m_index.end()){
+		// another thread decoded the same tile meanwhile
+		m_usage -= it->second->tile.total() * it->second->tile.elemSize();
+		m_entries.erase(it->second);
+		m_index.erase(it);
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.tile = tile;
+	m_entries.push_front(entry);
+	m_index[key] = m_entries.begin();
+	m_usage += bytes;
+	trim();
+}
+
+/**
+* drop every tile of the file, called when the file is written
+*/
+void KGDALTileCache::Invalidate(const cv::String& filename)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::list<Entry>::iterator it = m_entries.begin(); it != m_entries.end();){
+		if (it->key.filename == filename){
+			m_usage -= it->tile.total() * it->tile.elemSize();
+			m_index.erase(it->key);
+			it = m_entries.erase(it);
+		}
+		else{
+			++it;
+		}
+	}
+}
+
+/**
+* memory budget in bytes, 0 (the default) disables the cache
+*/
+void KGDALTileCache::SetBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_budget = bytes;
+	trim();
+}
+
+size_t KGDALTileCache::GetBudget() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_budget;
+}
+
+size_t KGDALTileCache::Usage() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_usage;
+}
+
+size_t KGDALTileCache::Hits() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+size_t KGDALTileCache::Misses() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+void KGDALTileCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.clear();
+	m_index.clear();
+	m_usage = 0;
+	m_hits = 0;
+	m_misses = 0;
+}
+
+/**
+* evict the least recently used tiles until the budget is kept, the caller holds the lock;
+* tiles still referenced by a reader stay alive through the Mat reference count
+*/
+void KGDALTileCache::trim()
+{
+	while (m_usage > m_budget && !m_entries.empty()){
+		m_usage -= m_entries.back().tile.total() * m_entries.back().tile.elemSize();
+		m_index.erase(m_entries.back().key);
+		m_entries.pop_back();
+	}
+}
+
+KGDALBandStats::KGDALBandStats() : min(std::numeric_limits<double>::max()), max(-std::numeric_limits<double>::max()),
+	sum(0), sumSq(0), count(0), histMin(0), histMax(0)
+{
+}
+
+double KGDALBandStats::Mean() const
+{
+	return count > 0 ? sum / count : 0;
+}
+
+double KGDALBandStats::StdDev() const
+{
+	if (count == 0) return 0;
+	const double mean = Mean();
+	return std::sqrt(std::max(0.0, sumSq / count - mean * mean));
+}
+
+/**
+* add the statistics of another part of the same raster, e.g. another tile
+*/
+void KGDALBandStats::Merge(const KGDALBandStats& other)
+{
+	min = std::min(min, other.min);
+	max = std::max(max, other.max);
+	sum += other.sum;
+	sumSq += other.sumSq;
+	count += other.count;
+
+	if (histogram.empty()){
+		histMin = other.histMin;
+		histMax = other.histMax;
+		histogram = other.histogram;
+	}
+	else if (histogram.size() == other.histogram.size() && histMin == other.histMin && histMax == other.histMax){
+		for (size_t i = 0; i < histogram.size(); i++) histogram[i] += other.histogram[i];
+	}
+}
+
+void KGDALStats::Merge(const KGDALStats& other)
+{
+	if (bands.empty()){
+		bands = other.bands;
+		return;
+	}
+	for (size_t c = 0; c < bands.size() && c < other.bands.size(); c++){
+		bands[c].Merge(other.bands[c]);
+	}
+}
+
+KGDALStretch::KGDALStretch(double clipLow, double clipHigh, double gamma)
+	: gamma(1, gamma), clipLow(clipLow), clipHigh(clipHigh)
+{
+}
+
+KGDALStretch::KGDALStretch(std::vector<double> low, std::vector<double> high, std::vector<double> gamma)
+	: low(low), high(high), gamma(gamma), clipLow(0), clipHigh(0)
+{
+}
+
+/**
+* the value below which percent of the counted values lie, from the histogram
+*/
+static double getPercentile(const KGDALBandStats& band, const double& percent)
+{
+	const double target = std::max(0.0, std::min(100.0, percent)) / 100.0 * band.count;
+	const double binWidth = (band.histMax - band.histMin) / band.histogram.size();
+
+	double seen = 0;
+	for (size_t i = 0; i < band.histogram.size(); i++){
+		seen += band.histogram[i];
+		if (seen >= target && seen > 0) return std::min(band.max, std::max(band.min, band.histMin + i * binWidth));
+	}
+	return band.max;
+}
+
+/**
+* stretch from the statistics of a read, the clip needs their histograms, without them
+* the stretch goes from min to max
+*/
+KGDALStretch::KGDALStretch(const KGDALStats& stats, double clipLow, double clipHigh, double gamma)
+	: gamma(1, gamma), clipLow(clipLow), clipHigh(clipHigh)
+{
+	for (size_t c = 0; c < stats.bands.size(); c++){
+		const KGDALBandStats& band = stats.bands[c];
+		if (band.count == 0){
+			low.push_back(0);
+			high.push_back(0);
+		}
+		else if (band.histogram.empty()){
+			low.push_back(band.min);
+			high.push_back(band.max);
+		}
+		else{
+			low.push_back(getPercentile(band, clipLow));
+			high.push_back(getPercentile(band, 100 - clipHigh));
+		}
+	}
 }
@@ -5,19 +5,112 @@
 #include <gdal.h>
 
 #include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct KGDALBandStats
+{
+	double min;
+	double max;
+	double sum;
+	double sumSq;
+	size_t count;
+
+	// bin i counts the values in [histMin + i * binWidth, histMin + (i + 1) * binWidth)
+	double histMin;
+	double histMax;
+	std::vector<size_t> histogram;
+
+	KGDALBandStats();
+	double Mean() const;
+	double StdDev() const;
+	void Merge(const KGDALBandStats&);
+};
+
+struct KGDALStats
+{
+	// one entry per channel of the image, in the channel order
+	std::vector<KGDALBandStats> bands;
+	void Merge(const KGDALStats&);
+};
+
+// contrast stretch of a read to CV_8U (0..255) or CV_32F (0..1), per channel; a value v maps to
+// t^(1 / gamma) for t = (v - low) / (high - low) clamped to [0, 1]
+struct KGDALStretch
+{
+	// one value per channel, a single value is used for all the channels; without low
+	// and high they are taken from the data, clipLow / clipHigh percent cut at either end
+	std::vector<double> low;
+	std::vector<double> high;
+	std::vector<double> gamma;
+	double clipLow;
+	double clipHigh;
+
+	KGDALStretch(double clipLow = 0, double clipHigh = 0, double gamma = 1);
+	KGDALStretch(std::vector<double> low, std::vector<double> high, std::vector<double> gamma = std::vector<double>());
+	KGDALStretch(const KGDALStats&, double clipLow = 0, double clipHigh = 0, double gamma = 1);
+};
+
+// process wide setup of GDAL, applied once before the first dataset is opened
+struct KGDALInitOptions
+{
+	// drivers to register, e.g. {"GTiff", "VRT", "MEM"}; empty registers all of them
+	std::vector<cv::String> drivers;
+	// block cache of GDAL in bytes, 0 keeps the default of GDAL
+	size_t cacheBytes;
+	// GDAL_NUM_THREADS of the drivers, -1 for ALL_CPUS, 0 keeps the default
+	int numThreads;
+
+	KGDALInitOptions();
+};
 
 class KGDAL2CV
 {
+	friend class KGDALTileIterator;
+	friend class KGDALAsyncReader;
+	friend class KGDALReader;
 public:
 	KGDAL2CV();
 	~KGDAL2CV();
-	bool ImgWriteByGDAL(GDALDataset *, const cv::Mat, int = 0, int = 0);
+	bool ImgWriteByGDAL(GDALDataset *, const cv::Mat, int = 0, int = 0, bool = false);
+	bool ImgWriteByGDAL(GDALDataset *, const cv::Mat, const cv::Mat, int = 0, int = 0, bool = false);
 	bool ImgWriteByGDAL(GDALRasterBand *, const cv::Mat, int = 0, int = 0);
-	cv::Mat ImgReadByGDAL(cv::String, bool = true);
-	cv::Mat ImgReadByGDAL(cv::String, int, int, int, int, bool = true);
-	cv::Mat ImgReadByGDAL(GDALRasterBand*, int, int, int, int);
-	cv::Mat ImgReadByGDAL(GDALRasterBand*);
+	cv::Mat ImgReadByGDAL(const cv::String&, bool = true, int = -1);
+	cv::Mat ImgReadByGDAL(const cv::String&, int, int, int, int, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, cv::OutputArray, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, int, int, int, int, cv::OutputArray, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, cv::OutputArray, cv::OutputArray, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, int, int, int, int, cv::OutputArray, cv::OutputArray, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, cv::OutputArray, KGDALStats&, bool = false, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, int, int, int, int, cv::OutputArray, KGDALStats&, bool = false, bool = true, int = -1);
+	bool ImgReadByGDAL(const cv::String&, cv::OutputArray, const KGDALStretch&, int = CV_8U, bool = true);
+	bool ImgReadByGDAL(const cv::String&, int, int, int, int, cv::OutputArray, const KGDALStretch&, int = CV_8U, bool = true);
+	bool ImgReadByGDAL(const cv::String&, const std::vector<cv::Rect>&, std::vector<cv::Mat>&, bool = true, int = -1);
+	cv::Mat ImgReadByGDAL(const cv::String&, cv::Size, double = 0, double = 0, int = cv::INTER_LINEAR, bool = true, int = -1);
+	cv::Mat ImgReadByGDAL(const cv::String&, int, int, int, int, cv::Size, double = 0, double = 0, int = cv::INTER_LINEAR, bool = true, int = -1);
+	cv::Mat ImgReadByGDAL(GDALRasterBand*, int, int, int, int, int = -1);
+	cv::Mat ImgReadByGDAL(GDALRasterBand*, int = -1);
+	cv::Mat ImgMapByGDAL(const cv::String&, bool = true);
+	GDALDataset* CreateByGDAL(const cv::String&, int, int, int, int, const cv::String& = "GTiff", char** = nullptr);
+	GDALDataset* WrapByGDAL(cv::Mat, bool = false);
+	bool EncodeByGDAL(const cv::String&, const cv::Mat, std::vector<uchar>&, char** = nullptr, bool = false);
+	cv::Mat DecodeByGDAL(cv::InputArray, bool = true, int = -1);
+	bool WriteCOGByGDAL(const cv::String&, const cv::Mat, const cv::String& = "DEFLATE", int = 512, bool = false, char** = nullptr);
+	bool WriteCOGByGDAL(const cv::String&, int, int, int, const std::function<bool(const cv::Rect&, cv::Mat&)>&, const cv::String& = "DEFLATE", int = 512, bool = false, char** = nullptr);
+	bool BuildOverviews(GDALDataset*, std::vector<int> = std::vector<int>{ 2, 4, 8, 16 }, int = cv::INTER_AREA);
+	void SetNumThreads(int);
 	void Close();
+	static bool Initialize(const KGDALInitOptions& = KGDALInitOptions());
 private:
 	GDALDataset* m_dataset;
 	cv::String m_filename;
@@ -29,20 +122,230 @@ private:
 
 	int m_type;
 	int m_nBand;
+	int m_nThreads;
 
 	bool readHeader();
-	bool readData(cv::Mat img);
-	int gdal2opencv(const GDALDataType&, const int&);
-	int gdalPaletteInterpretation2OpenCV(GDALPaletteInterp const&, GDALDataType const&);
-	void write_ctable_pixel(const double&, const GDALDataType&, GDALColorTable const*, cv::Mat&, const int&, const int&, const int&);
-	void write_pixel(const double&, const GDALDataType&, const int&, cv::Mat&, const int&, const int&, const int&);
-	double range_cast(const GDALDataType&, const int&, const double&);
-	double range_cast_inv(const GDALDataType&, const int&, const double&);
+	bool readData(cv::Mat img, cv::Mat mask = cv::Mat(), KGDALStats* = nullptr);
+	bool readDataParallel(cv::Mat&, cv::Mat&, KGDALStats*);
+	// the conversion core only works on its arguments, so KGDALReader shares it between threads
+	static bool readWindow(GDALDataset*, const int&, const int&, cv::Mat&, const int& = -1, const cv::Size& = cv::Size(), const int& = cv::INTER_NEAREST);
+	static bool readWindowScaled(GDALDataset*, const cv::Rect&, cv::Mat&, const int&);
+	static int getBestOverview(GDALDataset*, const cv::Rect&, const cv::Size&);
+	bool buildOverviewLevel(GDALRasterBand*, GDALRasterBand*, const int&, const int&);
+	cv::Mat mapData(const int&);
+	static bool readWindowCached(const cv::String&, GDALDataset*, const int&, const int&, cv::Mat&);
+	static bool readWindowStrips(GDALDataset*, const int&, const int&, cv::Mat&, cv::Mat&, KGDALStats*);
+	static bool readMask(GDALDataset*, const int&, const int&, const cv::Mat&, cv::Mat&);
+	static bool initStats(GDALDataset*, const int&, const bool&, KGDALStats&);
+	static bool binStats(GDALDataset*, const int&, const int&, const cv::Mat&, KGDALStats&);
+	static bool getCachedStats(GDALDataset*, const int&, KGDALStats&);
+	bool checkWindow(const int&, const int&, int&, int&);
+	static bool getStretch(GDALDataset*, const cv::Rect&, const int&, const KGDALStretch&, std::vector<double>&, std::vector<double>&, std::vector<double>&);
+	static bool readWindowStretch(GDALDataset*, const int&, const int&, cv::Mat&, const std::vector<double>&, const std::vector<double>&, const std::vector<double>&);
+	static bool readBand(GDALRasterBand*, const int&, GDALColorTable const*, const int&, const int&, cv::Mat&, const int&, const cv::Size& = cv::Size(), const int& = cv::INTER_NEAREST);
+	static bool readBandNative(GDALRasterBand*, const int&, const int&, cv::Mat&, const int&, const cv::Size& = cv::Size(), const int& = cv::INTER_NEAREST);
+	static bool readBandConvert(GDALRasterBand*, const int&, const int&, cv::Mat&, const int&, const cv::Size& = cv::Size(), const int& = cv::INTER_NEAREST);
+	static bool readBandStretch(GDALRasterBand*, const int&, const int&, cv::Mat&, const int&, const double&, const double&, const double&);
+	static bool readBandPalette(GDALRasterBand*, GDALColorTable const*, const int&, const int&, cv::Mat&, const cv::Size& = cv::Size());
+	static bool readDatasetNative(GDALDataset*, const cv::Rect&, cv::Mat&, const int& = cv::INTER_NEAREST);
+	static bool getBandMap(GDALDataset*, const int&, std::vector<int>&);
+	bool writeBandNative(GDALRasterBand*, const int&, const int&, const cv::Mat&, const int&);
+	bool writeDatasetNative(GDALDataset*, const int&, const int&, const cv::Mat&, std::vector<int>&);
+	bool writeCOG(const cv::String&, GDALDataset*, const cv::String&, const int&, char**);
+	bool writeMasked(GDALDataset*, const int&, const int&, const cv::Mat&, std::vector<int>&, const cv::Mat&);
+	static int gdal2opencv(const GDALDataType&, const int&);
+	static GDALDataType opencv2gdal(const int&);
+	static bool isNativeCast(const GDALDataType&, const int&);
+	static bool checkDepth(const int&);
+	static int gdalPaletteInterpretation2OpenCV(GDALPaletteInterp const&, GDALDataType const&);
+	static void write_pixel(const double&, const GDALDataType&, const int&, cv::Mat&, const int&, const int&, const int&);
+	static double range_cast(const GDALDataType&, const int&, const double&);
+	static double range_cast_inv(const GDALDataType&, const int&, const double&);
 	bool CheckDataType(const GDALDataType&, cv::Mat);
+	int outputType(const bool&, const int&);
+	int getThreadCount() const;
 	//ֹԼֵ
 	KGDAL2CV(const KGDAL2CV&);
 	KGDAL2CV& operator=(const KGDAL2CV&);
 };
 
+struct KGDALTile
+{
+	cv::Mat image;
+	cv::Rect window;
+	cv::Rect core;
+};
+
+class KGDALTileIterator
+{
+public:
+	KGDALTileIterator();
+	~KGDALTileIterator();
+	bool Open(const cv::String&, int, int, int = 0, int = 0, bool = true, int = -1);
+	bool Next(KGDALTile&);
+	void Reset();
+	int Count() const;
+	void Close();
+private:
+	KGDAL2CV m_reader;
+	cv::Mat m_buffer;
+
+	int m_tileWidth;
+	int m_tileHeight;
+	int m_overlap;
+	int m_halo;
+	int m_type;
+
+	int m_nCols;
+	int m_nRows;
+	int m_index;
+
+	KGDALTileIterator(const KGDALTileIterator&);
+	KGDALTileIterator& operator=(const KGDALTileIterator&);
+};
+
+class KGDALAsyncReader
+{
+public:
+	KGDALAsyncReader();
+	~KGDALAsyncReader();
+	bool Open(const cv::String&, int = 4, bool = true, int = -1);
+	std::future<cv::Mat> Submit(int, int, int, int);
+	bool Start(const std::vector<cv::Rect>&);
+	std::future<cv::Mat> Next();
+	void Close();
+private:
+	struct Request
+	{
+		cv::Rect window;
+		std::promise<cv::Mat> promise;
+	};
+
+	KGDAL2CV m_reader;
+	int m_type;
+	int m_prefetch;
+
+	std::deque<Request> m_requests;
+	std::deque<Request> m_scan;
+	std::deque<std::future<cv::Mat> > m_scanFutures;
+	int m_nIssued;
+	int m_nRead;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_workCond;
+	std::condition_variable m_spaceCond;
+	bool m_stop;
+
+	void run();
+	cv::Mat read(cv::Rect);
+	KGDALAsyncReader(const KGDALAsyncReader&);
+	KGDALAsyncReader& operator=(const KGDALAsyncReader&);
+};
+
+// Read is const and thread-safe, every call leases a GDALDataset of its own from KGDALDatasetCache;
+// Open and Close must not run concurrently with reads
+class KGDALReader
+{
+public:
+	KGDALReader();
+	bool Open(const cv::String&, bool = true, int = -1);
+	bool Read(int, int, int, int, cv::OutputArray) const;
+	bool Read(int, int, int, int, cv::OutputArray, cv::OutputArray) const;
+	bool Read(int, int, int, int, cv::Size, cv::OutputArray, int = cv::INTER_LINEAR) const;
+	cv::Mat Read(int, int, int, int) const;
+	int Width() const;
+	int Height() const;
+	int Type() const;
+	void Close();
+private:
+	cv::String m_filename;
+	int m_width;
+	int m_height;
+	int m_type;
+
+	bool getWindow(int, int, int, int, cv::Rect&) const;
+	KGDALReader(const KGDALReader&);
+	KGDALReader& operator=(const KGDALReader&);
+};
+
+class KGDALDatasetCache
+{
+public:
+	static KGDALDatasetCache& Instance();
+	GDALDataset* Acquire(const cv::String&);
+	void Release(GDALDataset*);
+	void Invalidate(const cv::String&);
+	void SetCapacity(int);
+	int GetCapacity() const;
+	size_t Hits() const;
+	size_t Misses() const;
+	void Clear();
+private:
+	struct Entry
+	{
+		cv::String filename;
+		GDALDataset* dataset;
+		int refCount;
+	};
+
+	// most recently used first
+	std::list<Entry> m_entries;
+	int m_capacity;
+	size_t m_hits;
+	size_t m_misses;
+	mutable std::mutex m_mutex;
+
+	void trim();
+	KGDALDatasetCache();
+	~KGDALDatasetCache();
+	KGDALDatasetCache(const KGDALDatasetCache&);
+	KGDALDatasetCache& operator=(const KGDALDatasetCache&);
+};
+
+class KGDALTileCache
+{
+public:
+	static KGDALTileCache& Instance();
+	bool Get(const cv::String&, const int&, const cv::Rect&, cv::Mat&);
+	void Put(const cv::String&, const int&, const cv::Rect&, const cv::Mat&);
+	void Invalidate(const cv::String&);
+	void SetBudget(size_t);
+	size_t GetBudget() const;
+	size_t Usage() const;
+	size_t Hits() const;
+	size_t Misses() const;
+	void Clear();
+private:
+	// file, output type and tile position, the type also fixes the bands that are read
+	struct Key
+	{
+		cv::String filename;
+		int type;
+		int x;
+		int y;
+		bool operator<(const Key&) const;
+	};
+	struct Entry
+	{
+		Key key;
+		cv::Mat tile;
+	};
+
+	// most recently used first
+	std::list<Entry> m_entries;
+	std::map<Key, std::list<Entry>::iterator> m_index;
+	size_t m_budget;
+	size_t m_usage;
+	size_t m_hits;
+	size_t m_misses;
+	mutable std::mutex m_mutex;
+
+	void trim();
+	KGDALTileCache();
+	KGDALTileCache(const KGDALTileCache&);
+	KGDALTileCache& operator=(const KGDALTileCache&);
+};
+
 
 #endif /*__GDAL_CV_HPP__*/